@@ -0,0 +1,34 @@
+#ifndef BOOK_H
+#define BOOK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "settings.h"
+#include "types.h"
+#include "util.h"
+
+/**
+ * Opening Book Public API
+ *
+ * Reads Polyglot (.bin) opening books. A book is a file of 16-byte big-endian entries sorted by
+ * the Polyglot hash of the position, so it is memory mapped and binary searched; nothing is
+ * read up front and a lookup touches a handful of pages.
+ *
+ * The Polyglot hash is fixed by the format and is unrelated to the engine's Zobrist hash.
+ */
+
+// Map the book at path, replacing any open book. "<empty>" or an empty path closes the book.
+// Returns false if the file cannot be used.
+bool book_open(const char *path);
+
+void book_close(void);
+
+// Choose a book move for the board. With best set, the move with the highest weight is taken;
+// otherwise moves are drawn at random in proportion to their weights. Returns false if the
+// position is not in the book or no book is open.
+bool book_probe(board *b, move *m, bool best);
+
+// The Polyglot hash of the board
+uint64_t polyglot_key(board *b);
+
+#endif
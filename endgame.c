@@ -0,0 +1,283 @@
+#include "endgame.h"
+#include "evaluate.h"
+#include "search.h"
+
+/*
+ * Squares are numbered row * 8 + col, so a1 = 0 and h8 = 63. Each evaluator sees the board
+ * from the side with the material, and returns a score for that side.
+ */
+
+typedef int (*endgame_fn)(board *b, bool strong_white);
+
+typedef struct endgame_entry {
+	uint64_t key; // material_key of the ending
+	endgame_fn evaluate;
+	bool strong_white; // the side with the material is white
+} endgame_entry;
+
+static endgame_entry endgames[32];
+static int endgame_count = 0;
+
+static inline int square(coord c) {
+	return c.row * 8 + c.col;
+}
+
+static inline int distance(int s1, int s2) {
+	return max(abs((s1 & 7) - (s2 & 7)), abs((s1 >> 3) - (s2 >> 3)));
+}
+
+// The square of the first piece of this kind, scanning from a1
+static int find_piece(board *b, char type, bool white) {
+	for (int sq = 0; sq < 64; sq++) {
+		piece p = b->b[sq & 7][sq >> 3];
+		if (p.type == type && p.white == white) return sq;
+	}
+	return -1;
+}
+
+/*
+ * KPK bitbase
+ *
+ * One bit for each white king, black king, side to move, and white pawn on files a-d and ranks
+ * 2-7; pawns on files e-h are mirrored. Bit set: white wins.
+ */
+
+#define KPK_SIZE (2 * 24 * 64 * 64)
+
+enum { KPK_INVALID = 0, KPK_UNKNOWN = 1, KPK_DRAW = 2, KPK_WIN = 4 };
+
+static uint32_t kpk_bitbase[KPK_SIZE / 32];
+
+static inline int kpk_index(int black_to_move, int black_king, int white_king, int pawn) {
+	return white_king | (black_king << 6) | (black_to_move << 12) | ((pawn & 7) << 13) | ((6 - (pawn >> 3)) << 15);
+}
+
+static inline bool pawn_attacks(int pawn, int sq) {
+	return (sq >> 3) == (pawn >> 3) + 1 && abs((sq & 7) - (pawn & 7)) == 1;
+}
+
+// The squares a king on sq can step to; returns how many
+static int king_steps(int sq, int steps[8]) {
+	int count = 0;
+	for (int dr = -1; dr <= 1; dr++) {
+		for (int dc = -1; dc <= 1; dc++) {
+			int r = (sq >> 3) + dr, c = (sq & 7) + dc;
+			if ((dr != 0 || dc != 0) && r >= 0 && r <= 7 && c >= 0 && c <= 7) steps[count++] = r * 8 + c;
+		}
+	}
+	return count;
+}
+
+// Results that follow from the position alone
+static uint8_t kpk_initial(int idx) {
+	int white_king = idx & 0x3F, black_king = (idx >> 6) & 0x3F, black_to_move = (idx >> 12) & 1;
+	int pawn = ((idx >> 13) & 0x3) + 8 * (6 - ((idx >> 15) & 0x7));
+	if (distance(white_king, black_king) <= 1 || white_king == pawn || black_king == pawn
+		|| (!black_to_move && pawn_attacks(pawn, black_king))) return KPK_INVALID;
+
+	// The pawn promotes and cannot be taken
+	if (!black_to_move && (pawn >> 3) == 6 && white_king != pawn + 8
+		&& (distance(black_king, pawn + 8) > 1 || distance(white_king, pawn + 8) == 1)) return KPK_WIN;
+
+	if (black_to_move) {
+		// Stalemate, or the pawn falls
+		int steps[8], count = king_steps(black_king, steps);
+		bool can_move = false;
+		for (int i = 0; i < count; i++) {
+			if (distance(steps[i], white_king) > 1 && !pawn_attacks(pawn, steps[i])) can_move = true;
+		}
+		if (!can_move) return KPK_DRAW;
+		if (distance(black_king, pawn) == 1 && distance(white_king, pawn) > 1) return KPK_DRAW;
+	}
+	return KPK_UNKNOWN;
+}
+
+// White to move wins if any move wins, and draws if all moves draw; black to move draws if any
+// move draws, and loses if all moves lose. Otherwise the position is still unknown.
+static uint8_t kpk_classify(const uint8_t *db, int idx) {
+	int white_king = idx & 0x3F, black_king = (idx >> 6) & 0x3F, black_to_move = (idx >> 12) & 1;
+	int pawn = ((idx >> 13) & 0x3) + 8 * (6 - ((idx >> 15) & 0x7));
+	int good = black_to_move ? KPK_DRAW : KPK_WIN;
+	int bad = black_to_move ? KPK_WIN : KPK_DRAW;
+
+	int result = KPK_INVALID;
+	int steps[8], count = king_steps(black_to_move ? black_king : white_king, steps);
+	for (int i = 0; i < count; i++) {
+		result |= black_to_move ? db[kpk_index(0, steps[i], white_king, pawn)] : db[kpk_index(1, black_king, steps[i], pawn)];
+	}
+	if (!black_to_move) {
+		if ((pawn >> 3) < 6) result |= db[kpk_index(1, black_king, white_king, pawn + 8)];
+		if ((pawn >> 3) == 1 && pawn + 8 != white_king && pawn + 8 != black_king) {
+			result |= db[kpk_index(1, black_king, white_king, pawn + 16)];
+		}
+	}
+	return (result & good) ? good : (result & KPK_UNKNOWN) ? KPK_UNKNOWN : bad;
+}
+
+static void kpk_init(void) {
+	uint8_t *db = malloc(KPK_SIZE);
+	for (int idx = 0; idx < KPK_SIZE; idx++) db[idx] = kpk_initial(idx);
+	bool changed = true;
+	while (changed) { // Each pass resolves positions one move further from a known result
+		changed = false;
+		for (int idx = 0; idx < KPK_SIZE; idx++) {
+			if (db[idx] == KPK_UNKNOWN && (db[idx] = kpk_classify(db, idx)) != KPK_UNKNOWN) changed = true;
+		}
+	}
+	memset(kpk_bitbase, 0, sizeof(kpk_bitbase));
+	for (int idx = 0; idx < KPK_SIZE; idx++) {
+		if (db[idx] == KPK_WIN) kpk_bitbase[idx >> 5] |= 1u << (idx & 31);
+	}
+	free(db);
+}
+
+bool kpk_probe(int white_king, int white_pawn, int black_king, bool white_to_move) {
+	assert((white_pawn & 7) <= 3);
+	int idx = kpk_index(!white_to_move, black_king, white_king, white_pawn);
+	return (kpk_bitbase[idx >> 5] >> (idx & 31)) & 1;
+}
+
+/*
+ * Evaluators
+ */
+
+// Bonuses for driving the lone king to the edge and approaching it
+static inline int push_to_edge(int sq) {
+	int rank_distance = min(sq >> 3, 7 - (sq >> 3)), file_distance = min(sq & 7, 7 - (sq & 7));
+	return 90 - (7 * file_distance * file_distance / 2 + 7 * rank_distance * rank_distance / 2);
+}
+
+static inline int push_close(int s1, int s2) {
+	return 140 - 20 * distance(s1, s2);
+}
+
+// Highest in the a1 and h8 corners
+static inline int push_to_corner(int sq) {
+	return abs(7 - (sq >> 3) - (sq & 7));
+}
+
+static int strong_material(board *b, bool strong_white) {
+	int total = 0;
+	for (int i = 0; i < 5; i++) total += b->piece_counts[i + (strong_white ? 0 : 6)] * piece_value("PNBRQ"[i]);
+	return total;
+}
+
+static int eval_draw(board *b, bool strong_white) {
+	(void) b;
+	(void) strong_white;
+	return 0;
+}
+
+// Whether a piece of the strong side attacks sq, seeing through the lone king on ignore, which
+// would no longer block once it stepped. The strong side has only a king, rooks and queens.
+static bool strong_attacks(board *b, int sq, int ignore, bool strong_white) {
+	for (int from = 0; from < 64; from++) {
+		piece p = b->b[from & 7][from >> 3];
+		if (p_eq(p, no_piece) || p.white != strong_white || from == sq) continue;
+		int dc = (sq & 7) - (from & 7), dr = (sq >> 3) - (from >> 3);
+		if (p.type == 'K') {
+			if (distance(from, sq) == 1) return true;
+			continue;
+		}
+		bool line = (dc == 0 || dr == 0), diagonal = (abs(dc) == abs(dr));
+		if (!(line || (diagonal && p.type == 'Q'))) continue;
+		int step = ((dr > 0) - (dr < 0)) * 8 + ((dc > 0) - (dc < 0));
+		int s = from + step;
+		while (s != sq && (s == ignore || p_eq(b->b[s & 7][s >> 3], no_piece))) s += step;
+		if (s == sq) return true;
+	}
+	return false;
+}
+
+// Whether the lone king on sq, to move, is stalemated: not in check, and every step attacked.
+// A strong piece on a step can be taken unless it is defended.
+static bool lone_king_stalemated(board *b, int sq, bool strong_white) {
+	if (strong_attacks(b, sq, sq, strong_white)) return false;
+	int steps[8], count = king_steps(sq, steps);
+	for (int i = 0; i < count; i++) {
+		if (!strong_attacks(b, steps[i], sq, strong_white)) return false;
+	}
+	return true;
+}
+
+// A king and a heavy piece against a lone king; mates by driving it to the edge
+static int eval_kxk(board *b, bool strong_white) {
+	int strong_king = square(strong_white ? b->white_king : b->black_king);
+	int weak_king = square(strong_white ? b->black_king : b->white_king);
+	if (b->black_to_move == strong_white && lone_king_stalemated(b, weak_king, strong_white)) return 0;
+	return known_win_score + strong_material(b, strong_white) + push_to_edge(weak_king)
+		+ push_close(strong_king, weak_king);
+}
+
+// Bishop and knight mate only in a corner the bishop controls
+static int eval_kbnk(board *b, bool strong_white) {
+	int strong_king = square(strong_white ? b->white_king : b->black_king);
+	int weak_king = square(strong_white ? b->black_king : b->white_king);
+	int bishop = find_piece(b, 'B', strong_white);
+	bool light_bishop = ((bishop >> 3) + (bishop & 7)) & 1;
+	int corner_distance = push_to_corner(light_bishop ? weak_king ^ 7 : weak_king); // mirror a8/h1 onto a1/h8
+	return known_win_score + strong_material(b, strong_white) + push_close(strong_king, weak_king)
+		+ 40 * corner_distance;
+}
+
+static int eval_kpk(board *b, bool strong_white) {
+	int strong_king = square(strong_white ? b->white_king : b->black_king);
+	int weak_king = square(strong_white ? b->black_king : b->white_king);
+	int pawn = find_piece(b, 'P', strong_white);
+	if (!strong_white) { // Make the strong side white
+		strong_king ^= 56;
+		weak_king ^= 56;
+		pawn ^= 56;
+	}
+	if ((pawn & 7) > 3) { // The bitbase holds pawns on files a-d
+		strong_king ^= 7;
+		weak_king ^= 7;
+		pawn ^= 7;
+	}
+	if (!kpk_probe(strong_king, pawn, weak_king, b->black_to_move != strong_white)) return 0;
+	return known_win_score + piece_value('P') + (pawn >> 3);
+}
+
+/*
+ * Dispatch
+ */
+
+// Register an ending by its pieces, like "KRvK", with the side that has the material first
+static void add_endgame(const char *code, endgame_fn evaluator) {
+	uint8_t counts[12] = {0};
+	int side = 0;
+	for (const char *c = code; *c; c++) {
+		if (*c == 'v') side = 6;
+		else counts[side + (int) (strchr("PNBRQK", *c) - "PNBRQK")]++;
+	}
+	uint8_t swapped[12];
+	for (int i = 0; i < 12; i++) swapped[i] = counts[(i + 6) % 12];
+	endgames[endgame_count++] = (endgame_entry) {material_key(counts), evaluator, true};
+	endgames[endgame_count++] = (endgame_entry) {material_key(swapped), evaluator, false};
+}
+
+void endgame_init(void) {
+	kpk_init();
+	endgame_count = 0;
+	add_endgame("KPvK", eval_kpk);
+	add_endgame("KRvK", eval_kxk);
+	add_endgame("KQvK", eval_kxk);
+	add_endgame("KBNvK", eval_kbnk);
+	add_endgame("KvK", eval_draw);
+	add_endgame("KNvK", eval_draw);
+	add_endgame("KBvK", eval_draw);
+	add_endgame("KNNvK", eval_draw);
+}
+
+bool endgame_evaluate(board *b, int *score) {
+	if (b->phase > endgame_max_phase) return false;
+	uint64_t key = material_key(b->piece_counts);
+	for (int i = 0; i < endgame_count; i++) {
+		if (endgames[i].key == key) {
+			int strong_score = endgames[i].evaluate(b, endgames[i].strong_white);
+			*score = endgames[i].strong_white ? strong_score : -strong_score;
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,33 @@
+#ifndef ENDGAME_H
+#define ENDGAME_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "settings.h"
+#include "types.h"
+#include "util.h"
+
+/**
+ * Endgame Knowledge Public API
+ *
+ * Exact or near-exact evaluations of trivial endings, chosen by the material on the board:
+ *   KPK       probes a bitbase built by retrograde analysis at startup
+ *   KRK, KQK  drive the lone king to the edge
+ *   KBNK      drive the lone king to a corner the bishop controls
+ *   KK, KNK, KBK, KNNK  are draws
+ */
+
+// The most phase (see evaluate.h) any specialized ending has; others need not be looked up
+#define endgame_max_phase 4
+
+// Build the KPK bitbase and the table of specialized endings. Call once at startup.
+void endgame_init(void);
+
+// Evaluate the board with a specialized function if its material has one. Returns false if
+// not; otherwise the score is stored, in centipawns from white's perspective.
+bool endgame_evaluate(board *b, int *score);
+
+// Whether white, with a king and a pawn against a king, wins. Squares are row * 8 + col.
+bool kpk_probe(int white_king, int white_pawn, int black_king, bool white_to_move);
+
+#endif
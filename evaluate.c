@@ -1,4 +1,6 @@
 #include "evaluate.h"
+#include "endgame.h"
+#include "nnue.h"
 
 // transform coordinates to access piece tables
 static inline int ptw(int c, int r) {
@@ -11,11 +13,26 @@ static inline int ptb(int c, int r) {
 
 int piece_val(piece p);
 int square_by_square(board *b);
-int piece_square_val(piece p, int c, int r);
+void piece_square_terms(piece p, int c, int r, int *mg, int *eg);
+
+// Direct-mapped evaluation cache. Each entry packs the upper 32 bits of the hash with the score
+// in one word, so a racing reader sees either a whole entry or a miss, and needs no lock.
+static uint64_t eval_cache[1 << eval_cache_bits];
+
+// Pawn structure cache, keyed by the board's pawn hash. The check word is the key XOR the data,
+// so an entry torn by a racing writer fails verification and is treated as a miss.
+typedef struct pawn_entry {
+	uint64_t check;
+	uint64_t data; // score in the low 32 bits
+} pawn_entry;
+
+static pawn_entry pawn_cache[1 << pawn_hash_bits];
+
+int pawn_structure(board *b);
 
 // Piece-Square tables, from white's perspective
 
-static int ptable_pawn[64] = {  
+static int mg_ptable_pawn[64] = {  
    0,  0,  0,  0,  0,  0,  0,  0,
   20, 21, 22, 25, 25, 22, 21, 20,
   10, 10, 20, 20, 20, 20, 10, 10,
@@ -26,7 +43,7 @@ static int ptable_pawn[64] = {
    0,  0,  0,  0,  0,  0,  0,  0
 };
 
-static int ptable_knight[64] = {  
+static int mg_ptable_knight[64] = {  
    -20,  0,  0,  0,  0,  0,  0,-20,
    -15,  5,  6,  7,  7,  6,  5,-15,
    -10,  7, 16, 20, 20, 16,  7,-10,
@@ -37,7 +54,7 @@ static int ptable_knight[64] = {
    -20,  0,  0,  0,  0,  0,  0,-20
 };
 
-static int ptable_bishop[64] = {  
+static int mg_ptable_bishop[64] = {  
    0,  0,  0,  0,  0,  0,  0,  0,
    0, 10, 10, 20, 20, 10, 10,  0,
    0, 10, 30, 30, 30, 30, 10,  0,
@@ -48,7 +65,7 @@ static int ptable_bishop[64] = {
    0,  0,  0,  0,  0,  0,  0,  0
 };
 
-static int ptable_rook[64] = {  
+static int mg_ptable_rook[64] = {  
    0,  0,  0,  0,  0,  0,  0,  0,
    0, 10, 10, 10, 10, 10, 10,  0,
    0,  0,  0,  0,  0,  0,  0,  0,
@@ -59,7 +76,7 @@ static int ptable_rook[64] = {
    0,  0,  5,  0,  0,  5,  0,  0
 };
 
-static int ptable_queen[64] = {  
+static int mg_ptable_queen[64] = {  
    0,  0,  0,  0,  0,  0,  0,  0,
    0,  0,  0,  0,  0,  0,  0,  0,
    0,  0,  0,  0,  0,  0,  0,  0,
@@ -70,57 +87,295 @@ static int ptable_queen[64] = {
    0,  0,  0, 10,  0,  0,  0,  0
 };
 
-static int ptable_king[64] = {  
+static int mg_ptable_king[64] = {  
+  -40,-40,-40,-40,-40,-40,-40,-40,
+  -40,-40,-40,-40,-40,-40,-40,-40,
+  -40,-40,-40,-40,-40,-40,-40,-40,
+  -35,-35,-35,-40,-40,-35,-35,-35,
+  -25,-30,-30,-35,-35,-30,-30,-25,
+  -15,-20,-20,-25,-25,-20,-20,-15,
+    0,  0, -5,-10,-10, -5,  0,  0,
+    0,  5, 15,  0, 10,  0, 15,  5
+};
+
+// Endgame tables: pawns race forwards, and pieces (the king above all) head for the center
+
+static int eg_ptable_pawn[64] = {  
+   0,  0,  0,  0,  0,  0,  0,  0,
+  60, 60, 60, 60, 60, 60, 60, 60,
+  40, 40, 40, 40, 40, 40, 40, 40,
+  25, 25, 25, 25, 25, 25, 25, 25,
+  12, 12, 12, 12, 12, 12, 12, 12,
+   5,  5,  5,  5,  5,  5,  5,  5,
+   0,  0,  0,  0,  0,  0,  0,  0,
+   0,  0,  0,  0,  0,  0,  0,  0
+};
+
+static int eg_ptable_knight[64] = {  
+   -30,-20,-15,-15,-15,-15,-20,-30,
+   -20,-10,  0,  0,  0,  0,-10,-20,
+   -15,  0, 10, 15, 15, 10,  0,-15,
+   -15,  0, 15, 20, 20, 15,  0,-15,
+   -15,  0, 15, 20, 20, 15,  0,-15,
+   -15,  0, 10, 15, 15, 10,  0,-15,
+   -20,-10,  0,  0,  0,  0,-10,-20,
+   -30,-20,-15,-15,-15,-15,-20,-30
+};
+
+static int eg_ptable_bishop[64] = {  
+  -10, -5, -5, -5, -5, -5, -5,-10,
+   -5,  0,  0,  0,  0,  0,  0, -5,
+   -5,  0,  5, 10, 10,  5,  0, -5,
+   -5,  0, 10, 10, 10, 10,  0, -5,
+   -5,  0, 10, 10, 10, 10,  0, -5,
+   -5,  0,  5, 10, 10,  5,  0, -5,
+   -5,  0,  0,  0,  0,  0,  0, -5,
+  -10, -5, -5, -5, -5, -5, -5,-10
+};
+
+static int eg_ptable_rook[64] = {  
+   5,  5,  5,  5,  5,  5,  5,  5,
+  15, 15, 15, 15, 15, 15, 15, 15,
    0,  0,  0,  0,  0,  0,  0,  0,
    0,  0,  0,  0,  0,  0,  0,  0,
    0,  0,  0,  0,  0,  0,  0,  0,
-   0,  0,  0, 10, 10,  0,  0,  0,
-   0,  0,  0, 10, 10,  0,  0,  0,
    0,  0,  0,  0,  0,  0,  0,  0,
    0,  0,  0,  0,  0,  0,  0,  0,
-   0,  0, 15,  0, 10,  0, 15,  0
+   0,  0,  0,  0,  0,  0,  0,  0
+};
+
+static int eg_ptable_queen[64] = {  
+  -20,-10,-10, -5, -5,-10,-10,-20,
+  -10,  0,  5,  5,  5,  5,  0,-10,
+  -10,  5, 10, 10, 10, 10,  5,-10,
+   -5,  5, 10, 15, 15, 10,  5, -5,
+   -5,  5, 10, 15, 15, 10,  5, -5,
+  -10,  5, 10, 10, 10, 10,  5,-10,
+  -10,  0,  5,  5,  5,  5,  0,-10,
+  -20,-10,-10, -5, -5,-10,-10,-20
+};
+
+static int eg_ptable_king[64] = {  
+  -50,-35,-25,-20,-20,-25,-35,-50,
+  -35,-15, -5,  0,  0, -5,-15,-35,
+  -25, -5, 15, 20, 20, 15, -5,-25,
+  -20,  0, 20, 30, 30, 20,  0,-20,
+  -20,  0, 20, 30, 30, 20,  0,-20,
+  -25, -5, 15, 20, 20, 15, -5,-25,
+  -35,-15, -5,  0,  0, -5,-15,-35,
+  -50,-35,-25,-20,-20,-25,-35,-50
 };
 
+// Tables indexed by piece_index() % 6. Kings carry no material here, since they always cancel out.
+static int *mg_ptables[6] = {mg_ptable_pawn, mg_ptable_knight, mg_ptable_bishop, mg_ptable_rook, mg_ptable_queen, mg_ptable_king};
+static int *eg_ptables[6] = {eg_ptable_pawn, eg_ptable_knight, eg_ptable_bishop, eg_ptable_rook, eg_ptable_queen, eg_ptable_king};
+static const int mg_material[6] = {100, 320, 325, 500, 900, 0};
+static const int eg_material[6] = {115, 300, 320, 530, 950, 0};
+static const int phase_weight[6] = {0, 1, 1, 2, 4, 0}; // Sums to max_phase for the starting position
+
+// Blend midgame and endgame scores by the game phase
+static inline int taper(int mg, int eg, int phase) {
+	phase = min(phase, max_phase); // Promotions can push the phase past its starting value
+	return (mg * phase + eg * (max_phase - phase)) / max_phase;
+}
+
 // Statically evaluates a board position.
 // Positive numbers indicate white advantage.
 // Returns result in centipawns.
 int evaluate(board *b) {
-	int score = 0;
-	score += square_by_square(b);
+	if (debug_incremental_eval) {
+		board check_board = *b;
+		eval_refresh(&check_board);
+		assert(b->mg == check_board.mg && b->eg == check_board.eg && b->phase == check_board.phase);
+	}
+	int score;
+	if (use_endgame_evaluators && endgame_evaluate(b, &score)) return score; // Trivial endings are known
+	uint64_t *slot = NULL;
+	uint32_t check = (uint32_t) (b->hash >> 32);
+	if (use_eval_cache) {
+		slot = eval_cache + (b->hash & ((1 << eval_cache_bits) - 1));
+		uint64_t entry = __atomic_load_n(slot, __ATOMIC_RELAXED);
+		if (entry != 0 && (uint32_t) (entry >> 32) == check) return (int32_t) (uint32_t) entry;
+	}
+	if (nnue_active()) {
+		score = nnue_evaluate(b);
+		if (debug_incremental_eval) nnue_verify(b);
+	} else {
+		score = taper(b->mg, b->eg, b->phase);
+		score += pawn_structure(b);
+		if (b->piece_counts[2] == 2) score += bishop_pair_bonus;
+		if (b->piece_counts[8] == 2) score -= bishop_pair_bonus;
+		if (debug_incremental_eval) assert(score == square_by_square(b));
+	}
+	if (use_eval_cache) __atomic_store_n(slot, ((uint64_t) check << 32) | (uint32_t) score, __ATOMIC_RELAXED);
 	return score;
 }
 
+// Forget every cached evaluation; needed whenever the evaluation terms change
+void eval_cache_clear(void) {
+	memset(eval_cache, 0, sizeof(eval_cache));
+}
+
+// The full evaluation by rescanning the board, as a reference for the incremental fields
 int square_by_square(board *b) {
-   uint8_t black_pawns_by_col[8] = {0};
-   uint8_t white_pawns_by_col[8] = {0};
    uint8_t black_bishops = 0;
    uint8_t white_bishops = 0;
 
-	int eval = 0;
+	int mg = 0, eg = 0, phase = 0;
 	for (int c = 0; c < 8; c++) { // cols
 		for (int r = 0; r < 8; r++) { // rows
 			piece p = b->b[c][r];
-         if (p.type == 'P') {
-            if (p.white) white_pawns_by_col[c]++;
-            else black_pawns_by_col[c]++;
-         } else if (p.type == 'B') {
+         if (p.type == 'B') {
             if (p.white) white_bishops++;
             else black_bishops++;
          }
 			if (p_eq(no_piece, p)) continue;
-			eval += piece_val(p);
-			eval += piece_square_val(p, c, r);
+			int piece_mg, piece_eg;
+			piece_square_terms(p, c, r, &piece_mg, &piece_eg);
+			mg += piece_mg;
+			eg += piece_eg;
+			phase += phase_weight[piece_index(p) % 6];
 		}
 	}
-   for (int i = 0; i < 8; i++) {
-      if (black_pawns_by_col[i] > 1) eval += doubled_pawn_penalty;
-      if (white_pawns_by_col[i] > 1) eval -= doubled_pawn_penalty;
-   }
+	int eval = taper(mg, eg, phase);
+   eval += pawn_structure(b);
    if (black_bishops == 2) eval -= bishop_pair_bonus;
    if (white_bishops == 2) eval += bishop_pair_bonus;
 	return eval;
 }
 
+int evaluate_material(board *b) {
+	int eval = 0;
+	for (int c = 0; c < 8; c++) {
+		for (int r = 0; r < 8; r++) {
+			if (!p_eq(b->b[c][r], no_piece)) eval += piece_val(b->b[c][r]);
+		}
+	}
+	return eval;
+}
+
+void eval_refresh(board *b) {
+	b->mg = 0;
+	b->eg = 0;
+	b->phase = 0;
+	memset(b->piece_counts, 0, sizeof(b->piece_counts));
+	for (int c = 0; c < 8; c++) {
+		for (int r = 0; r < 8; r++) {
+			eval_square_update(b, (coord){c, r}, 1);
+		}
+	}
+}
+
+void eval_square_update(board *b, coord c, int sign) {
+	piece p = at(b, c);
+	if (p_eq(p, no_piece)) return;
+	int mg, eg;
+	piece_square_terms(p, c.col, c.row, &mg, &eg);
+	b->mg += sign * mg;
+	b->eg += sign * eg;
+	b->phase += sign * phase_weight[piece_index(p) % 6];
+	b->piece_counts[piece_index(p)] += sign;
+}
+
+void eval_get_terms(board *b, eval_terms *t) {
+	memset(t, 0, sizeof(eval_terms));
+	t->phase = (uint8_t) min(b->phase, max_phase);
+	int pawns_by_col[2][8] = {{0}};
+	for (int c = 0; c < 8; c++) {
+		for (int r = 0; r < 8; r++) {
+			piece p = b->b[c][r];
+			if (p_eq(p, no_piece)) continue;
+			int type = piece_index(p) % 6;
+			int sign = p.white ? 1 : -1;
+			int tableidx = (p.white) ? ptw(c, r) : ptb(c, r);
+			if (type < 5) t->material[type] += sign;
+			if (type == 0) pawns_by_col[p.white ? 0 : 1][c]++;
+			t->tables[t->table_count++] = (int16_t) (sign * (1 + type * 64 + tableidx));
+		}
+	}
+	for (int i = 0; i < 8; i++) {
+		if (pawns_by_col[0][i] > 1) t->doubled_pawns++;
+		if (pawns_by_col[1][i] > 1) t->doubled_pawns--;
+	}
+	t->bishop_pair = (b->piece_counts[2] == 2) - (b->piece_counts[8] == 2);
+}
+
+void eval_get_params(int *params) {
+	for (int type = 0; type < 5; type++) {
+		params[EVAL_PARAM_MG_MATERIAL + type] = mg_material[type];
+		params[EVAL_PARAM_EG_MATERIAL + type] = eg_material[type];
+	}
+	for (int type = 0; type < 6; type++) {
+		for (int i = 0; i < 64; i++) {
+			params[EVAL_PARAM_MG_TABLES + type * 64 + i] = mg_ptables[type][i];
+			params[EVAL_PARAM_EG_TABLES + type * 64 + i] = eg_ptables[type][i];
+		}
+	}
+	params[EVAL_PARAM_DOUBLED_PAWN] = doubled_pawn_penalty;
+	params[EVAL_PARAM_BISHOP_PAIR] = bishop_pair_bonus;
+}
+
+void eval_write_params(FILE *f, const int *params) {
+	static const char *names[6] = {"pawn", "knight", "bishop", "rook", "queen", "king"};
+	fprintf(f, "// Tuned evaluation parameters; replace the matching definitions in evaluate.c and settings.h\n\n");
+	for (int phase = 0; phase < 2; phase++) {
+		const char *prefix = phase == 0 ? "mg" : "eg";
+		int tables = phase == 0 ? EVAL_PARAM_MG_TABLES : EVAL_PARAM_EG_TABLES;
+		for (int type = 0; type < 6; type++) {
+			fprintf(f, "static int %s_ptable_%s[64] = {  \n", prefix, names[type]);
+			for (int row = 0; row < 8; row++) {
+				fprintf(f, " ");
+				for (int col = 0; col < 8; col++) {
+					fprintf(f, "%4d%s", params[tables + type * 64 + row * 8 + col], (row == 7 && col == 7) ? "" : ",");
+				}
+				fprintf(f, "\n");
+			}
+			fprintf(f, "};\n\n");
+		}
+	}
+	int material = EVAL_PARAM_MG_MATERIAL;
+	fprintf(f, "static const int mg_material[6] = {%d, %d, %d, %d, %d, 0};\n", params[material], 
+		params[material + 1], params[material + 2], params[material + 3], params[material + 4]);
+	material = EVAL_PARAM_EG_MATERIAL;
+	fprintf(f, "static const int eg_material[6] = {%d, %d, %d, %d, %d, 0};\n", params[material], 
+		params[material + 1], params[material + 2], params[material + 3], params[material + 4]);
+	fprintf(f, "static const int doubled_pawn_penalty = %d;\n", params[EVAL_PARAM_DOUBLED_PAWN]);
+	fprintf(f, "static const int bishop_pair_bonus = %d;\n", params[EVAL_PARAM_BISHOP_PAIR]);
+}
+
+// Scores the pawn structure from white's perspective, consulting the pawn cache first.
+int pawn_structure(board *b) {
+	pawn_entry *slot = pawn_cache + (b->pawn_hash & ((1 << pawn_hash_bits) - 1));
+	if (use_pawn_hash) {
+		uint64_t check = __atomic_load_n(&slot->check, __ATOMIC_RELAXED);
+		uint64_t data = __atomic_load_n(&slot->data, __ATOMIC_RELAXED);
+		if ((check ^ data) == b->pawn_hash) return (int32_t) (uint32_t) data;
+	}
+
+	uint8_t black_pawns_by_col[8] = {0};
+	uint8_t white_pawns_by_col[8] = {0};
+	for (int c = 0; c < 8; c++) {
+		for (int r = 1; r < 7; r++) { // pawns never stand on the back ranks
+			piece p = b->b[c][r];
+			if (p.type != 'P') continue;
+			if (p.white) white_pawns_by_col[c]++;
+			else black_pawns_by_col[c]++;
+		}
+	}
+	int eval = 0;
+	for (int i = 0; i < 8; i++) {
+		if (black_pawns_by_col[i] > 1) eval += doubled_pawn_penalty;
+		if (white_pawns_by_col[i] > 1) eval -= doubled_pawn_penalty;
+	}
+
+	if (use_pawn_hash) {
+		uint64_t data = (uint32_t) eval;
+		__atomic_store_n(&slot->check, b->pawn_hash ^ data, __ATOMIC_RELAXED);
+		__atomic_store_n(&slot->data, data, __ATOMIC_RELAXED);
+	}
+	return eval;
+}
+
 int piece_val(piece p) {
 	int piece_val;
 	switch (p.type) {
@@ -136,18 +391,18 @@ int piece_val(piece p) {
 	return piece_val;
 }
 
-int piece_square_val(piece p, int c, int r) {
+int piece_value(char type) {
+	return piece_val((piece){type, true});
+}
+
+// The midgame and endgame values (material plus table) of a piece on a square, from white's perspective
+void piece_square_terms(piece p, int c, int r, int *mg, int *eg) {
 	int tableidx = (p.white) ? ptw(c, r) : ptb(c, r);
-	int table_val;
-	switch (p.type) {
-		case 'P': table_val = ptable_pawn[tableidx]; break;
-		case 'N': table_val = ptable_knight[tableidx]; break;
-		case 'B': table_val = ptable_bishop[tableidx]; break;
-		case 'R': table_val = ptable_rook[tableidx]; break;
-		case 'Q': table_val = ptable_queen[tableidx]; break;
-		case 'K': table_val = ptable_king[tableidx]; break;
-		default: assert(false);
+	int type = piece_index(p) % 6;
+	*mg = mg_material[type] + mg_ptables[type][tableidx];
+	*eg = eg_material[type] + eg_ptables[type][tableidx];
+	if (!p.white) {
+		*mg = -*mg;
+		*eg = -*eg;
 	}
-	if (!p.white) table_val = -table_val;
-	return table_val;
 }
@@ -12,7 +12,53 @@
 #include "types.h"
 #include "util.h"
 
+// The game phase of the starting position; it falls towards zero as pieces come off
+static const int max_phase = 24;
+
 int evaluate(board *b);
 int evaluate_material(board *b);
 
+// Recompute the board's incremental evaluation fields from scratch
+void eval_refresh(board *b);
+
+// Add (sign 1) or remove (sign -1) the piece on c from the board's incremental evaluation fields.
+// Call with sign -1 before a piece leaves a square, and with sign 1 after one arrives.
+void eval_square_update(board *b, coord c, int sign);
+void eval_cache_clear(void);
+
+/*
+ * Tuning support. Without a network, evaluate() is linear in its parameters (up to rounding):
+ * the phase blends the midgame and endgame sums, and the pawn and bishop terms are added after.
+ */
+
+// Parameter layout: mg material P..Q, eg material P..Q, mg tables (6 * 64, ordered PNBRQK),
+// eg tables, doubled pawn penalty, bishop pair bonus
+#define EVAL_PARAM_MG_MATERIAL 0
+#define EVAL_PARAM_EG_MATERIAL 5
+#define EVAL_PARAM_MG_TABLES 10
+#define EVAL_PARAM_EG_TABLES (10 + 6 * 64)
+#define EVAL_PARAM_DOUBLED_PAWN (10 + 12 * 64)
+#define EVAL_PARAM_BISHOP_PAIR (EVAL_PARAM_DOUBLED_PAWN + 1)
+#define EVAL_PARAM_COUNT (EVAL_PARAM_BISHOP_PAIR + 1)
+
+// How often each parameter counts in a position, white minus black
+typedef struct eval_terms {
+	uint8_t phase; // clamped to max_phase
+	int8_t material[5]; // piece counts, P..Q
+	int8_t doubled_pawns; // files with doubled pawns; the penalty is subtracted
+	int8_t bishop_pair;
+	uint8_t table_count;
+	int16_t tables[32]; // +/-(1 + table offset) for each non-empty square, positive for white
+} eval_terms;
+
+void eval_get_terms(board *b, eval_terms *t);
+
+// Copy out the current parameters in the layout above
+void eval_get_params(int *params);
+
+// Write parameters as C definitions matching those in evaluate.c and settings.h
+void eval_write_params(FILE *f, const int *params);
+// The material value of a piece type in centipawns, regardless of color
+int piece_value(char type);
+
 #endif
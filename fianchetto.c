@@ -25,9 +25,11 @@
 #include "types.h"
 #include "util.h"
 #include "search.h"
+#include "endgame.h"
 #include "movegen.h"
 #include "ttable.h"
 #include "uci.h"
+#include "tuner.h"
 
 // limit for how many moves print_analysis should print
 static const int depth_limit = 50;
@@ -35,10 +37,13 @@ static const int depth_limit = 50;
 int repl(void);
 void print_moves(board *b);
 void print_board(board *b);
-void print_analysis(board *b);
-void iterative_deepen(board *b, int max_depth);
+void print_analysis(search_context *ctx, board *b);
+void iterative_deepen(search_context *ctx, board *b, int max_depth);
 
 int main(int argc, char* argv[]) {
+	srand((unsigned int) time(NULL)); // for book move choices; the Zobrist keys have their own seed
+	zobrist_init();
+	endgame_init();
 	if (always_use_debug_mode) repl();
 	// initilize logging
 	if (use_log_file) {
@@ -52,6 +57,12 @@ int main(int argc, char* argv[]) {
 	// Should we enter debug mode?
 	for (int i = 0; i < argc; i++) {
 		if(strcmp("-d", argv[i]) == 0) repl();
+		// Tune the evaluation: -t positions.epd [header.h] [epochs]
+		if (strcmp("-t", argv[i]) == 0 && i + 1 < argc) {
+			const char *header = (i + 2 < argc) ? argv[i + 2] : "tuned_params.h";
+			int epochs = (i + 3 < argc) ? atoi(argv[i + 3]) : 1000;
+			exit(tune(argv[i + 1], header, epochs) ? 0 : 1);
+		}
 	}
 	printf("info string To use the engine in command-line debug mode, run with the -d flag. Entering UCI mode.\n");
 	enter_uci(); // Enter UCI mode
@@ -59,8 +70,8 @@ int main(int argc, char* argv[]) {
 
 // Main debug-mode UI loop
 int repl(void) {
-	tt_init();
-	board b; 
+	search_context *ctx = search_context_create(NULL);
+	board b = {0}; 
 	reset_board(&b);
 	system("clear");
 	printf("%s %s by Dylan D. Hunn\nConsole Analysis Interface\n\n", engine_name, engine_version);
@@ -80,7 +91,10 @@ int repl(void) {
 			case 'e': // Search in a position and print the PV
 				printf("Calculating...\n");
 				system("clear");
-				iterative_deepen(&b, edepth);
+				tt_new_search(ctx->tt);
+				if (use_tt_telemetry) tt_telemetry_clear(ctx);
+				iterative_deepen(ctx, &b, edepth);
+				if (use_tt_telemetry) tt_telemetry_print(ctx, false);
 				printf("\n");
 				break;
 			case 'm': // Execute a move
@@ -93,7 +107,7 @@ int repl(void) {
 					printf("Read move: %s\n", move_to_string(m, buffer));
 					b.true_game_ply_clock++;
 					apply(&b, m);
-					if (clear_tt_every_move) tt_clear(); // for debugging
+					if (clear_tt_every_move) tt_clear(ctx->tt); // for debugging
 				}
 				printf("\n");
 				break;
@@ -144,13 +158,14 @@ void print_board(board *b) {
 }
 
 // Print the analysis (PV) of a position by consulting the Transposition Table.
-void print_analysis(board *b_orig) {
+void print_analysis(search_context *ctx, board *b_orig) {
 	int curr_depth = depth_limit;
-	searchstats sstats_stored = sstats;
+	searchstats sstats_stored;
+	stats_snapshot(&ctx, 1, &sstats_stored);
 	board b_cpy = *b_orig;
 	board *b = &b_cpy;
 	evaluation eval;
-	tt_get(b, &eval);
+	tt_get(ctx, b, &eval);
 	printf("d%d [%+.2f]: ", eval.depth, ((double)eval.score)/100); // Divide centipawn score
 	assert(!e_eq(eval, no_eval));
 	int moveno = (b->last_move_ply+2)/2;
@@ -165,24 +180,24 @@ void print_analysis(board *b_orig) {
 		if (eval.type == qexact || eval.type == qupperbound || eval.type == qlowerbound) printf("(q)");
 		printf("%s ", move_to_string(eval.best, move));
 		apply(b, eval.best);
-		tt_get(b, &eval);
+		tt_get(ctx, b, &eval);
 	} while (!e_eq(eval, no_eval) && curr_depth-- > 0);
 	double rate = ((double) sstats_stored.nodes_searched + sstats_stored.qnodes_searched) / sstats_stored.time;
 	printf("\n\t(%llu new nodes, %llu new qnodes, %llu qnode aborts, %.0fms, %.0fkN/s)", 
 		sstats_stored.nodes_searched, sstats_stored.qnodes_searched, sstats_stored.qnode_aborts, sstats_stored.time, rate);
 	
 	printf("\n\t(ttable: %llu/%llu = %.2f%% load, %llu hits, %llu misses, %llu inserts (with %llu overwrites), %llu insert failures)", 
-		get_tt_count(), get_tt_size(), tt_load(), sstats_stored.ttable_hits, sstats_stored.ttable_misses, sstats_stored.ttable_inserts, sstats_stored.ttable_overwrites, sstats_stored.ttable_insert_failures);
+		get_tt_count(ctx->tt), get_tt_size(ctx->tt), tt_load(ctx->tt), sstats_stored.ttable_hits, sstats_stored.ttable_misses, sstats_stored.ttable_inserts, sstats_stored.ttable_overwrites, sstats_stored.ttable_insert_failures);
 	printf("\n");
 }
 
-void iterative_deepen(board *b, int max_depth) {
+void iterative_deepen(search_context *ctx, board *b, int max_depth) {
 	printf("Iterative Deepening Analysis Results (including cached analysis)\n");
 	for (int i = 1; i <= max_depth; i++) {
-		clear_stats();
+		clear_stats(ctx);
 		printf("Searching at depth %d... ", i);
 		fflush(stdout);
-		search(b, i);
-		print_analysis(b);
+		search(ctx, b, i);
+		print_analysis(ctx, b);
 	}
 }
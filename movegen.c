@@ -22,8 +22,15 @@ static const char promo_p[] = {'Q', 'N', 'B', 'R'}; // promotion targets
 // Generates an array of valid moves, and populates the count.
 // TODO: Optimize to use hashsets of piece locations.
 move *board_moves(board *b, int *count, bool captures_only) {
-	bool white = !b->black_to_move;
 	move *moves = malloc(sizeof(move) * max_moves_in_list);
+	board_moves_into(b, moves, count, captures_only);
+	// TODO does this need to happen?
+	//moves = realloc(moves, sizeof(move) * ((*count) + 1)); // extra slot for working space
+	return moves;
+}
+
+void board_moves_into(board *b, move *moves, int *count, bool captures_only) {
+	bool white = !b->black_to_move;
 	*count = 0;
 	for (uint8_t i = 0; i < 8; i++) { // col
 		for (uint8_t j = 0; j < 8; j++) { // row
@@ -32,9 +39,6 @@ move *board_moves(board *b, int *count, bool captures_only) {
 		}
 
 	}
-	// TODO does this need to happen?
-	//moves = realloc(moves, sizeof(move) * ((*count) + 1)); // extra slot for working space
-	return moves;
 }
 
 bool is_legal_move(board *b, move m) {
@@ -44,6 +48,119 @@ bool is_legal_move(board *b, move m) {
 	return result;
 }
 
+// Whether the squares strictly between from and to, on a line or diagonal, are empty
+static bool path_clear(board *b, coord from, coord to) {
+	int dc = (to.col > from.col) - (to.col < from.col), dr = (to.row > from.row) - (to.row < from.row);
+	coord c = {from.col + dc, from.row + dr};
+	for (; !c_eq(c, to); c.col += dc, c.row += dr) {
+		if (!p_eq(at(b, c), no_piece)) return false;
+	}
+	return true;
+}
+
+// As pawn_moves would generate m; the piece on from is a pawn of the side to move
+static bool pawn_move_fits(board *b, move m, piece pawn) {
+	int dc = m.to.col - m.from.col, dr = m.to.row - m.from.row, dy = pawn.white ? 1 : -1;
+	bool promote = (m.to.row == 0 || m.to.row == 7);
+	if (promote != !p_eq(m.promote_to, no_piece)) return false;
+	if (promote && (m.promote_to.white != pawn.white || memchr(promo_p, m.promote_to.type, sizeof(promo_p)) == NULL)) return false;
+	if (dc == 0) { // a push
+		if (m.en_passant_capture || !p_eq(at(b, m.to), no_piece)) return false;
+		if (dr == dy) return true;
+		bool unmoved = m.from.row == (pawn.white ? 1 : 6);
+		return dr == 2 * dy && unmoved && p_eq(at(b, (coord){m.from.col, m.from.row + dy}), no_piece);
+	}
+	if (abs(dc) != 1 || dr != dy) return false;
+	int8_t en_passant_col = b->en_passant_pawn_push_col_history[b->last_move_ply];
+	bool en_passant = en_passant_col != -1 && c_eq(m.to, (coord){en_passant_col, pawn.white ? 5 : 2});
+	if (m.en_passant_capture != en_passant) return false;
+	return en_passant || !p_eq(at(b, m.to), no_piece);
+}
+
+// As castle_moves would generate m; the piece on from is the king of the side to move
+static bool castle_fits(board *b, move m, piece king) {
+	uint8_t row = king.white ? 0 : 7;
+	bool kingside = (m.to.col == 6);
+	if (!c_eq(m.from, (coord){4, row}) || m.to.row != row || (m.to.col != 6 && m.to.col != 2)) return false;
+	if (m.c != (kingside ? K : Q)) return false;
+	bool rights = king.white ? (kingside ? b->castle_rights_wk : b->castle_rights_wq) 
+		: (kingside ? b->castle_rights_bk : b->castle_rights_bq);
+	if (!rights || in_check(b, 4, row, b->black_to_move)) return false;
+	for (int i = kingside ? 5 : 3; i != (kingside ? 7 : 1); i += kingside ? 1 : -1) {
+		if (!p_eq(b->b[i][row], no_piece) || in_check(b, i, row, b->black_to_move)) return false;
+	}
+	return kingside || p_eq(b->b[1][row], no_piece);
+}
+
+// Checks the move against the rules for its piece directly, with no generation; agrees with
+// is_legal_move for moves of the side to move.
+bool is_pseudo_legal(board *b, move m) {
+	if (!in_bounds(m.from) || !in_bounds(m.to) || c_eq(m.from, m.to)) return false;
+	piece p = at(b, m.from), target = at(b, m.to);
+	if (p_eq(p, no_piece) || p.white == b->black_to_move) return false;
+	if (!p_eq(m.captured, target)) return false; // en passant takes from another square
+	if (!p_eq(target, no_piece) && target.white == p.white) return false;
+	if (p.type != 'P' && (m.en_passant_capture || !p_eq(m.promote_to, no_piece))) return false;
+	if (p.type != 'K' && m.c != N) return false;
+	int dc = abs(m.to.col - m.from.col), dr = abs(m.to.row - m.from.row);
+	switch(p.type) {
+		case 'P': return pawn_move_fits(b, m, p);
+		case 'N': return dc * dr == 2;
+		case 'B': return dc == dr && path_clear(b, m.from, m.to);
+		case 'R': return (dc == 0 || dr == 0) && path_clear(b, m.from, m.to);
+		case 'Q': return (dc == 0 || dr == 0 || dc == dr) && path_clear(b, m.from, m.to);
+		case 'K': return (dc <= 1 && dr <= 1) ? m.c == N : castle_fits(b, m, p);
+		default: assert(false);
+	}
+	return false;
+}
+
+// Whether a piece of type p standing on sq attacks target, with vacated counted as empty and
+// filled as occupied, as they will be once a move is made
+static bool attacks_after(board *b, piece p, coord sq, coord target, coord vacated, coord filled) {
+	int dc = target.col - sq.col, dr = target.row - sq.row;
+	switch(p.type) {
+		case 'P': return dr == (p.white ? 1 : -1) && abs(dc) == 1;
+		case 'N': return abs(dc * dr) == 2;
+		case 'K': return max(abs(dc), abs(dr)) == 1;
+		case 'B': if (abs(dc) != abs(dr)) return false; break;
+		case 'R': if (dc != 0 && dr != 0) return false; break;
+		case 'Q': if (dc != 0 && dr != 0 && abs(dc) != abs(dr)) return false; break;
+		default: return false;
+	}
+	int step_c = (dc > 0) - (dc < 0), step_r = (dr > 0) - (dr < 0);
+	for (coord c = {sq.col + step_c, sq.row + step_r}; !c_eq(c, target); c.col += step_c, c.row += step_r) {
+		if (c_eq(c, filled) || (!c_eq(c, vacated) && !p_eq(at(b, c), no_piece))) return false;
+	}
+	return true;
+}
+
+// Whether a quiet move (no capture or promotion) checks the opponent's king, found without
+// making it: the moved piece attacks the king directly, or uncovers a slider behind it
+bool gives_check(board *b, move m) {
+	piece mover = at(b, m.from);
+	coord king = mover.white ? b->black_king : b->white_king;
+	if (m.c != N) { // Castling: only the rook, now beside the king, can check
+		coord rook = {m.c == K ? 5 : 3, m.from.row};
+		return attacks_after(b, (piece){'R', mover.white}, rook, king, m.from, m.to);
+	}
+	if (attacks_after(b, mover, m.to, king, m.from, m.to)) return true;
+
+	// Discovered: look from the king through the vacated square for one of our sliders
+	int dc = m.from.col - king.col, dr = m.from.row - king.row;
+	bool diagonal = abs(dc) == abs(dr);
+	if (dc != 0 && dr != 0 && !diagonal) return false;
+	int step_c = (dc > 0) - (dc < 0), step_r = (dr > 0) - (dr < 0);
+	for (coord c = {king.col + step_c, king.row + step_r}; in_bounds(c); c.col += step_c, c.row += step_r) {
+		if (c_eq(c, m.to)) return false; // Moved along the line, still blocking it
+		if (c_eq(c, m.from)) continue;
+		piece p = at(b, c);
+		if (p_eq(p, no_piece)) continue;
+		return p.white == mover.white && (p.type == 'Q' || p.type == (diagonal ? 'B' : 'R'));
+	}
+	return false;
+}
+
 // Writes all legal moves for a piece to an array starting at index 0; 
 // returns the number of items added.
 int piece_moves(board *b, coord c, move *list, bool captures_only) {
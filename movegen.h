@@ -23,8 +23,16 @@
 // but this is not reflected in the count.)
 move *board_moves(board *b, int *count, bool captures_only);
 
+// As board_moves, but writes into a caller-provided list of at least max_moves_in_list moves.
+void board_moves_into(board *b, move *moves, int *count, bool captures_only);
+
 bool is_legal_move(board *b, move m);
 
+// Whether m is a pseudo-legal move for the side to move, exactly as board_moves would generate
+// it. Checked in constant time, without generating moves, so moves from the transposition
+// table can be validated cheaply.
+bool is_pseudo_legal(board *b, move m);
+
 // Fill a provided buffer with a move's string.
 char *move_to_string(move m, char str[6]);
 
@@ -35,6 +43,9 @@ bool string_to_move(board *b, char *str, move *m);
 // Determines if a specific square is under attack.
 bool in_check(board *b, int col, int row, bool by_white);
 
+// Whether a quiet move (no capture or promotion) gives check; the move is not made
+bool gives_check(board *b, move m);
+
 // checks if a given move, ALREADY applied, has put the specified color's king in check
 // this is slightly more efficient than in_check
 // precondition: the specified King was not already in check
@@ -42,6 +53,6 @@ bool puts_in_check(board *b, move m, bool black_king);
 
 // The maximum number of moves that can be stored in a move array
 // If any position results in more moves than this, a segfault will occur
-static int max_moves_in_list = 150; 
+static int max_moves_in_list = MAX_MOVES; 
 
 #endif
@@ -0,0 +1,384 @@
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "nnue.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NNUE_X86
+#endif
+
+#define NNUE_HEADER_BYTES 64
+
+// The mapped weights file, and views into it
+static const uint8_t *nnue_map = NULL;
+static size_t nnue_map_bytes = 0;
+static const int16_t *ft_biases;
+static const int16_t *ft_weights;
+static const int32_t *l2_biases;
+static const int8_t *l2_weights;
+static const int32_t *l3_biases;
+static const int8_t *l3_weights;
+static const int32_t *out_bias;
+static const int8_t *out_weights;
+
+/*
+ * Kernels. Each has a scalar version and, on x86, SSE and AVX2 versions selected at load time.
+ * All of them compute exactly the same integers.
+ */
+
+static void acc_add_scalar(int16_t *acc, const int16_t *w) {
+	for (int i = 0; i < NNUE_HIDDEN; i++) acc[i] = (int16_t) (acc[i] + w[i]);
+}
+
+static void acc_sub_scalar(int16_t *acc, const int16_t *w) {
+	for (int i = 0; i < NNUE_HIDDEN; i++) acc[i] = (int16_t) (acc[i] - w[i]);
+}
+
+// out[i] = bias[i] + dot(in, weights[i]); n_in must be a multiple of 32
+static void dense_scalar(const uint8_t *in, int n_in, const int8_t *w, const int32_t *bias, int32_t *out, int n_out) {
+	for (int i = 0; i < n_out; i++) {
+		int32_t sum = bias[i];
+		for (int j = 0; j < n_in; j++) sum += in[j] * w[i * n_in + j];
+		out[i] = sum;
+	}
+}
+
+#ifdef NNUE_X86
+__attribute__((target("sse2")))
+static void acc_add_sse(int16_t *acc, const int16_t *w) {
+	for (int i = 0; i < NNUE_HIDDEN; i += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i *) (acc + i));
+		__m128i b = _mm_loadu_si128((const __m128i *) (w + i));
+		_mm_storeu_si128((__m128i *) (acc + i), _mm_add_epi16(a, b));
+	}
+}
+
+__attribute__((target("sse2")))
+static void acc_sub_sse(int16_t *acc, const int16_t *w) {
+	for (int i = 0; i < NNUE_HIDDEN; i += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i *) (acc + i));
+		__m128i b = _mm_loadu_si128((const __m128i *) (w + i));
+		_mm_storeu_si128((__m128i *) (acc + i), _mm_sub_epi16(a, b));
+	}
+}
+
+// Inputs are at most 127, so the pairwise int16 sums of maddubs cannot saturate
+__attribute__((target("ssse3")))
+static void dense_sse(const uint8_t *in, int n_in, const int8_t *w, const int32_t *bias, int32_t *out, int n_out) {
+	const __m128i ones = _mm_set1_epi16(1);
+	for (int i = 0; i < n_out; i++) {
+		__m128i sum = _mm_setzero_si128();
+		for (int j = 0; j < n_in; j += 16) {
+			__m128i a = _mm_loadu_si128((const __m128i *) (in + j));
+			__m128i b = _mm_loadu_si128((const __m128i *) (w + i * n_in + j));
+			sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_maddubs_epi16(a, b), ones));
+		}
+		sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0x4E));
+		sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, 0xB1));
+		out[i] = bias[i] + _mm_cvtsi128_si32(sum);
+	}
+}
+
+__attribute__((target("avx2")))
+static void acc_add_avx2(int16_t *acc, const int16_t *w) {
+	for (int i = 0; i < NNUE_HIDDEN; i += 16) {
+		__m256i a = _mm256_loadu_si256((const __m256i *) (acc + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *) (w + i));
+		_mm256_storeu_si256((__m256i *) (acc + i), _mm256_add_epi16(a, b));
+	}
+}
+
+__attribute__((target("avx2")))
+static void acc_sub_avx2(int16_t *acc, const int16_t *w) {
+	for (int i = 0; i < NNUE_HIDDEN; i += 16) {
+		__m256i a = _mm256_loadu_si256((const __m256i *) (acc + i));
+		__m256i b = _mm256_loadu_si256((const __m256i *) (w + i));
+		_mm256_storeu_si256((__m256i *) (acc + i), _mm256_sub_epi16(a, b));
+	}
+}
+
+__attribute__((target("avx2")))
+static void dense_avx2(const uint8_t *in, int n_in, const int8_t *w, const int32_t *bias, int32_t *out, int n_out) {
+	const __m256i ones = _mm256_set1_epi16(1);
+	for (int i = 0; i < n_out; i++) {
+		__m256i sum = _mm256_setzero_si256();
+		for (int j = 0; j < n_in; j += 32) {
+			__m256i a = _mm256_loadu_si256((const __m256i *) (in + j));
+			__m256i b = _mm256_loadu_si256((const __m256i *) (w + i * n_in + j));
+			sum = _mm256_add_epi32(sum, _mm256_madd_epi16(_mm256_maddubs_epi16(a, b), ones));
+		}
+		__m128i half = _mm_add_epi32(_mm256_castsi256_si128(sum), _mm256_extracti128_si256(sum, 1));
+		half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0x4E));
+		half = _mm_add_epi32(half, _mm_shuffle_epi32(half, 0xB1));
+		out[i] = bias[i] + _mm_cvtsi128_si32(half);
+	}
+}
+#endif
+
+static void (*acc_add)(int16_t *acc, const int16_t *w) = acc_add_scalar;
+static void (*acc_sub)(int16_t *acc, const int16_t *w) = acc_sub_scalar;
+static void (*dense)(const uint8_t *in, int n_in, const int8_t *w, const int32_t *bias, int32_t *out, int n_out) = dense_scalar;
+
+static const char *select_kernels(void) {
+#ifdef NNUE_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		acc_add = acc_add_avx2;
+		acc_sub = acc_sub_avx2;
+		dense = dense_avx2;
+		return "avx2";
+	}
+	if (__builtin_cpu_supports("ssse3")) {
+		acc_add = acc_add_sse;
+		acc_sub = acc_sub_sse;
+		dense = dense_sse;
+		return "sse";
+	}
+#endif
+	acc_add = acc_add_scalar;
+	acc_sub = acc_sub_scalar;
+	dense = dense_scalar;
+	return "scalar";
+}
+
+/*
+ * Loading
+ */
+
+static uint32_t read_u32(const uint8_t *p) {
+	return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+bool nnue_load(const char *path) {
+	const size_t expected = NNUE_HEADER_BYTES
+		+ NNUE_HIDDEN * sizeof(int16_t) + (size_t) NNUE_INPUTS * NNUE_HIDDEN * sizeof(int16_t)
+		+ NNUE_L2 * sizeof(int32_t) + NNUE_L2 * 2 * NNUE_HIDDEN
+		+ NNUE_L3 * sizeof(int32_t) + NNUE_L3 * NNUE_L2
+		+ sizeof(int32_t) + NNUE_L3;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		stdout_fprintf(logstr, "info string could not open network file %s\n", path);
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size != expected) {
+		stdout_fprintf(logstr, "info string network file %s has the wrong size\n", path);
+		close(fd);
+		return false;
+	}
+	void *map = mmap(NULL, expected, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		stdout_fprintf(logstr, "info string could not map network file %s\n", path);
+		return false;
+	}
+	const uint8_t *p = map;
+	if (memcmp(p, "FNNUE001", 8) != 0 || read_u32(p + 8) != 1 || read_u32(p + 12) != NNUE_INPUTS
+		|| read_u32(p + 16) != NNUE_HIDDEN || read_u32(p + 20) != NNUE_L2 || read_u32(p + 24) != NNUE_L3) {
+		stdout_fprintf(logstr, "info string network file %s has an unsupported header\n", path);
+		munmap(map, expected);
+		return false;
+	}
+	madvise(map, expected, MADV_WILLNEED);
+
+	nnue_unload();
+	nnue_map = p;
+	nnue_map_bytes = expected;
+	p += NNUE_HEADER_BYTES;
+	ft_biases = (const int16_t *) p; p += NNUE_HIDDEN * sizeof(int16_t);
+	ft_weights = (const int16_t *) p; p += (size_t) NNUE_INPUTS * NNUE_HIDDEN * sizeof(int16_t);
+	l2_biases = (const int32_t *) p; p += NNUE_L2 * sizeof(int32_t);
+	l2_weights = (const int8_t *) p; p += NNUE_L2 * 2 * NNUE_HIDDEN;
+	l3_biases = (const int32_t *) p; p += NNUE_L3 * sizeof(int32_t);
+	l3_weights = (const int8_t *) p; p += NNUE_L3 * NNUE_L2;
+	out_bias = (const int32_t *) p; p += sizeof(int32_t);
+	out_weights = (const int8_t *) p;
+	const char *kernels = select_kernels();
+	stdout_fprintf(logstr, "info string loaded network %s using %s kernels\n", path, kernels);
+	return true;
+}
+
+void nnue_unload(void) {
+	if (nnue_map != NULL) munmap((void *) nnue_map, nnue_map_bytes);
+	nnue_map = NULL;
+	nnue_map_bytes = 0;
+}
+
+bool nnue_active(void) {
+	return nnue_map != NULL;
+}
+
+/*
+ * Accumulators
+ */
+
+// The input index of a piece on a square, as seen by one side (0 white, 1 black).
+// Black sees the board flipped, so both sides look at their own pieces from the bottom.
+static inline int feature_index(int side, coord king, piece p, coord c) {
+	int ksq = king.row * 8 + king.col;
+	int sq = c.row * 8 + c.col;
+	if (side == 1) {
+		ksq ^= 56;
+		sq ^= 56;
+	}
+	int type = piece_index(p) % 6; // never a king
+	if (p.white != (side == 0)) type += 5;
+	return ksq * 640 + type * 64 + sq;
+}
+
+static inline coord side_king(board *b, int side) {
+	return side == 0 ? b->white_king : b->black_king;
+}
+
+static void refresh_side(board *b, nnue_accumulator *acc, int side) {
+	int16_t *values = acc->values[side];
+	memcpy(values, ft_biases, sizeof(acc->values[side]));
+	coord king = side_king(b, side);
+	for (uint8_t c = 0; c < 8; c++) {
+		for (uint8_t r = 0; r < 8; r++) {
+			piece p = b->b[c][r];
+			if (p_eq(p, no_piece) || p.type == 'K') continue;
+			acc_add(values, ft_weights + (size_t) feature_index(side, king, p, (coord){c, r}) * NNUE_HIDDEN);
+		}
+	}
+	acc->computed[side] = true;
+}
+
+// Bring the accumulators of the current position up to date, from the nearest computed entry
+static void update_accumulators(board *b) {
+	nnue_accumulator *stack = b->nnue_stack;
+	nnue_accumulator *top = stack + b->nnue_top;
+	for (int side = 0; side < 2; side++) {
+		if (top->computed[side]) continue;
+		int i = b->nnue_top;
+		while (!stack[i].computed[side] && !stack[i].refresh[side] && i > 0) i--;
+		if (!stack[i].computed[side]) {
+			refresh_side(b, top, side); // Cheaper than replaying moves across a king move
+			continue;
+		}
+		// The king of this side has not moved since entry i, so it stands where it does now
+		coord king = side_king(b, side);
+		for (int j = i + 1; j <= b->nnue_top; j++) {
+			nnue_accumulator *acc = stack + j;
+			memcpy(acc->values[side], stack[j - 1].values[side], sizeof(acc->values[side]));
+			for (int k = 0; k < acc->dirty_count; k++) {
+				const int16_t *w = ft_weights
+					+ (size_t) feature_index(side, king, acc->dirty_piece[k], acc->dirty_square[k]) * NNUE_HIDDEN;
+				if (acc->dirty_sign[k] > 0) acc_add(acc->values[side], w);
+				else acc_sub(acc->values[side], w);
+			}
+			acc->computed[side] = true;
+		}
+	}
+}
+
+static void mark_stale(nnue_accumulator *acc) {
+	acc->computed[0] = acc->computed[1] = false;
+	acc->refresh[0] = acc->refresh[1] = true;
+	acc->dirty_count = 0;
+}
+
+void nnue_reset(board *b) {
+	if (b->nnue_stack == NULL) return;
+	b->nnue_top = 0;
+	b->nnue_overflow = 0;
+	mark_stale(b->nnue_stack);
+}
+
+void nnue_push_entry(board *b) {
+	if (b->nnue_overflow > 0 || b->nnue_top == NNUE_STACK_SIZE - 1) {
+		// Out of entries: keep reusing the top one, rebuilt from scratch when needed
+		b->nnue_overflow++;
+		mark_stale(b->nnue_stack + b->nnue_top);
+		return;
+	}
+	b->nnue_top++;
+	nnue_accumulator *acc = b->nnue_stack + b->nnue_top;
+	acc->computed[0] = acc->computed[1] = false;
+	acc->refresh[0] = acc->refresh[1] = false;
+	acc->dirty_count = 0;
+}
+
+void nnue_pop_entry(board *b) {
+	if (b->nnue_overflow > 0) {
+		b->nnue_overflow--;
+		mark_stale(b->nnue_stack + b->nnue_top);
+	} else if (b->nnue_top == 0) {
+		mark_stale(b->nnue_stack); // Unapplied past the root
+	} else {
+		b->nnue_top--;
+	}
+}
+
+void nnue_record_entry(board *b, coord c, int sign) {
+	nnue_accumulator *acc = b->nnue_stack + b->nnue_top;
+	piece p = at(b, c);
+	if (p_eq(p, no_piece)) return;
+	if (p.type == 'K') {
+		acc->refresh[p.white ? 0 : 1] = true;
+		return;
+	}
+	assert(acc->dirty_count < 4);
+	acc->dirty_piece[acc->dirty_count] = p;
+	acc->dirty_square[acc->dirty_count] = c;
+	acc->dirty_sign[acc->dirty_count] = (int8_t) sign;
+	acc->dirty_count++;
+}
+
+void nnue_attach(board *b, nnue_accumulator **stack) {
+	if (*stack == NULL && posix_memalign((void **) stack, 64, sizeof(nnue_accumulator) * NNUE_STACK_SIZE) != 0) assert(false);
+	b->nnue_stack = *stack;
+	nnue_reset(b);
+}
+
+/*
+ * Inference
+ */
+
+static inline void clip(const int32_t *in, uint8_t *out, int n, int shift) {
+	for (int i = 0; i < n; i++) {
+		int32_t v = in[i] >> shift;
+		out[i] = (uint8_t) (v < 0 ? 0 : (v > 127 ? 127 : v));
+	}
+}
+
+int nnue_evaluate(board *b) {
+	assert(nnue_active());
+	if (b->nnue_stack == NULL) nnue_attach(b, &b->nnue_stack);
+	update_accumulators(b);
+	nnue_accumulator *acc = b->nnue_stack + b->nnue_top;
+
+	// The side to move's view goes first
+	uint8_t input[2 * NNUE_HIDDEN] __attribute__((aligned(64)));
+	int us = b->black_to_move ? 1 : 0;
+	for (int half = 0; half < 2; half++) {
+		const int16_t *values = acc->values[half == 0 ? us : !us];
+		for (int i = 0; i < NNUE_HIDDEN; i++) {
+			int16_t v = values[i];
+			input[half * NNUE_HIDDEN + i] = (uint8_t) (v < 0 ? 0 : (v > 127 ? 127 : v));
+		}
+	}
+	int32_t l2_out[NNUE_L2], l3_out[NNUE_L3], output;
+	uint8_t l2_clipped[NNUE_L2] __attribute__((aligned(64)));
+	uint8_t l3_clipped[NNUE_L3] __attribute__((aligned(64)));
+	dense(input, 2 * NNUE_HIDDEN, l2_weights, l2_biases, l2_out, NNUE_L2);
+	clip(l2_out, l2_clipped, NNUE_L2, NNUE_WEIGHT_SHIFT);
+	dense(l2_clipped, NNUE_L2, l3_weights, l3_biases, l3_out, NNUE_L3);
+	clip(l3_out, l3_clipped, NNUE_L3, NNUE_WEIGHT_SHIFT);
+	dense_scalar(l3_clipped, NNUE_L3, out_weights, out_bias, &output, 1);
+
+	int score = output / NNUE_OUTPUT_SCALE;
+	return b->black_to_move ? -score : score;
+}
+
+void nnue_verify(board *b) {
+	if (b->nnue_stack == NULL) return;
+	update_accumulators(b);
+	nnue_accumulator fresh;
+	for (int side = 0; side < 2; side++) {
+		refresh_side(b, &fresh, side);
+		assert(memcmp(fresh.values[side], b->nnue_stack[b->nnue_top].values[side], sizeof(fresh.values[side])) == 0);
+	}
+}
@@ -0,0 +1,94 @@
+#ifndef NNUE_H
+#define NNUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "settings.h"
+#include "types.h"
+#include "util.h"
+
+/**
+ * NNUE Evaluation Public API
+ *
+ * An optional neural network evaluation, used in place of the hand-written terms when a weights
+ * file is loaded. The network is HalfKP-like: for each side, every non-king piece is a feature
+ * relative to that side's king, feeding a 256-wide accumulator per side. The accumulators are
+ * updated incrementally as moves are applied, and then pass through two small int8 layers:
+ *
+ *   2x40960 -> 2x256 (int16) -> 32 -> 32 -> 1
+ *
+ * Weights file format (little-endian), validated against these sizes when loaded:
+ *   64-byte header: "FNNUE001", then uint32 version (1), inputs (40960), hidden (256),
+ *                   l2 (32) and l3 (32), then zero padding
+ *   int16 feature biases[256],       int16 feature weights[40960][256]
+ *   int32 l2 biases[32],             int8 l2 weights[32][512]
+ *   int32 l3 biases[32],             int8 l3 weights[32][32]
+ *   int32 output bias,               int8 output weights[32]
+ *
+ * Accumulators are clipped to [0, 127] before the first dense layer; dense layer outputs are
+ * shifted right by NNUE_WEIGHT_SHIFT and clipped the same way. The output is divided by
+ * NNUE_OUTPUT_SCALE to give centipawns for the side to move.
+ */
+
+#define NNUE_INPUTS 40960 // 64 king squares * 10 piece types * 64 squares
+#define NNUE_HIDDEN 256
+#define NNUE_L2 32
+#define NNUE_L3 32
+#define NNUE_STACK_SIZE 256 // accumulators kept per board, one per ply from the root
+#define NNUE_WEIGHT_SHIFT 6 // dense layer outputs are scaled down by 2^6
+#define NNUE_OUTPUT_SCALE 16 // network output units per centipawn
+
+// One ply of incremental state. Entries above a computed one only record what the move changed.
+typedef struct nnue_accumulator {
+	int16_t values[2][NNUE_HIDDEN] __attribute__((aligned(64))); // white's view, then black's
+	bool computed[2];
+	bool refresh[2]; // this side's king moved (or the stack was reset), so rebuild from scratch
+	uint8_t dirty_count;
+	piece dirty_piece[4];
+	coord dirty_square[4];
+	int8_t dirty_sign[4];
+} nnue_accumulator;
+
+// Map a weights file and switch evaluation over to it. Returns false (and keeps the current
+// evaluation) if the file is missing or malformed.
+bool nnue_load(const char *path);
+
+// Unmap the network and return to the hand-written evaluation.
+void nnue_unload(void);
+
+// Whether a network is loaded.
+bool nnue_active(void);
+
+// The network's evaluation of a board, from white's perspective.
+int nnue_evaluate(board *b);
+
+// Assert that the incremental accumulators match ones rebuilt from scratch.
+void nnue_verify(board *b);
+
+// Re-root a board's accumulator stack at its current position.
+// Call whenever a board is set up other than by apply().
+void nnue_reset(board *b);
+
+// Root a board's accumulators in *stack, allocating it the first time, so that boards copied
+// for each search can reuse one stack. Free the stack with free().
+void nnue_attach(board *b, nnue_accumulator **stack);
+
+// Hooks for apply and unapply; they do nothing until a board is first evaluated by the network
+void nnue_push_entry(board *b);
+void nnue_pop_entry(board *b);
+void nnue_record_entry(board *b, coord c, int sign);
+
+static inline void nnue_push(board *b) {
+	if (b->nnue_stack != NULL) nnue_push_entry(b);
+}
+
+static inline void nnue_pop(board *b) {
+	if (b->nnue_stack != NULL) nnue_pop_entry(b);
+}
+
+// Record that the piece on c was removed (sign -1, before it leaves) or placed (sign 1, after)
+static inline void nnue_record(board *b, coord c, int sign) {
+	if (b->nnue_stack != NULL) nnue_record_entry(b, c, sign);
+}
+
+#endif
@@ -1,27 +1,90 @@
 #include "search.h"
 
-// Search statistics; set by last call to search()
-searchstats sstats;
-
 // Local functions
-int mtd_f(board *b, int ply);
+int mtd_f(search_context *ctx, board *b, int ply);
+int mtd_f_guess(search_context *ctx, board *b, int ply, int g);
 //int abq_multithread(board *b, int alpha, int beta, int ply, int centiply_extension, bool allow_extensions, bool side_to_move_in_check);
 void *abq_multithread_entrypoint(void *param);
-int abq(board *b, int alpha, int beta, int ply, int centiply_extension, bool allow_extensions, bool side_to_move_in_check);
+int abq(search_context *ctx, board *b, int alpha, int beta, int ply, int centiply_extension, bool allow_extensions, bool side_to_move_in_check);
 int relative_evaluation(board *b);
 int capture_move_comparator(const board *board, const move *a, const move *b);
+void order_moves(search_context *ctx, board *b, move *moves, int count);
+void update_history(search_context *ctx, board *b, move m, int ply);
+void update_pv(search_context *ctx, int height, move m);
+int filter_captures_and_checks(board *b, move *moves, int count);
+void set_stats_progress(search_context *ctx, int depth, double time);
+bool root_move_dominates(search_context *ctx, board *b, move best, int score, int ply);
+
+search_context *search_context_create(ttable *shared_tt) {
+	search_context *ctx = NULL;
+	if (posix_memalign((void **) &ctx, 64, sizeof(search_context)) != 0) assert(false);
+	memset(ctx, 0, sizeof(search_context));
+	if (shared_tt != NULL) {
+		ctx->tt = shared_tt;
+		ctx->owns_tt = false;
+	} else {
+		ctx->tt = calloc(1, sizeof(ttable));
+		assert(ctx->tt != NULL);
+		ctx->tt->megabytes = tt_megabytes;
+		tt_init(ctx->tt);
+		ctx->owns_tt = true;
+	}
+	ctx->pv_move = no_move;
+	ctx->pv_reply = no_move;
+	return ctx;
+}
+
+void search_context_destroy(search_context *ctx) {
+	if (ctx->owns_tt) {
+		tt_free(ctx->tt);
+		free(ctx->tt);
+	}
+	free(ctx->nnue_stack);
+	free(ctx);
+}
 
-void clear_stats() {
-	sstats.time = 0;
-	sstats.depth = 0;
-	sstats.nodes_searched = 0;
-	sstats.qnodes_searched = 0;
-	sstats.qnode_aborts = 0;
-	sstats.ttable_inserts = 0;
-	sstats.ttable_insert_failures = 0;
-	sstats.ttable_hits = 0;
-	sstats.ttable_misses = 0;
-	sstats.ttable_overwrites = 0;
+void search_context_clear(search_context *ctx) {
+	memset(ctx->history, 0, sizeof(ctx->history));
+	ctx->pv_move = no_move;
+	ctx->pv_reply = no_move;
+}
+
+void clear_stats(search_context *ctx) {
+	set_stats_progress(ctx, 0, 0);
+	stat_set(&ctx->stats.nodes_searched, 0);
+	stat_set(&ctx->stats.qnodes_searched, 0);
+	stat_set(&ctx->stats.qnode_aborts, 0);
+	stat_set(&ctx->stats.ttable_inserts, 0);
+	stat_set(&ctx->stats.ttable_insert_failures, 0);
+	stat_set(&ctx->stats.ttable_hits, 0);
+	stat_set(&ctx->stats.ttable_misses, 0);
+	stat_set(&ctx->stats.ttable_overwrites, 0);
+}
+
+void set_stats_progress(search_context *ctx, int depth, double time) {
+	__atomic_store_n(&ctx->stats.depth, depth, __ATOMIC_RELAXED);
+	__atomic_store(&ctx->stats.time, &time, __ATOMIC_RELAXED);
+}
+
+// Sums the counters block by block with relaxed loads; the workers never wait on the reader.
+// Depth and time are the maximum over the contexts.
+void stats_snapshot(search_context **contexts, int count, searchstats *out) {
+	memset(out, 0, sizeof(searchstats));
+	for (int i = 0; i < count; i++) {
+		searchstats *s = &contexts[i]->stats;
+		double time;
+		__atomic_load(&s->time, &time, __ATOMIC_RELAXED);
+		out->time = fmax(out->time, time);
+		out->depth = max(out->depth, __atomic_load_n(&s->depth, __ATOMIC_RELAXED));
+		out->nodes_searched += __atomic_load_n(&s->nodes_searched, __ATOMIC_RELAXED);
+		out->qnodes_searched += __atomic_load_n(&s->qnodes_searched, __ATOMIC_RELAXED);
+		out->qnode_aborts += __atomic_load_n(&s->qnode_aborts, __ATOMIC_RELAXED);
+		out->ttable_inserts += __atomic_load_n(&s->ttable_inserts, __ATOMIC_RELAXED);
+		out->ttable_insert_failures += __atomic_load_n(&s->ttable_insert_failures, __ATOMIC_RELAXED);
+		out->ttable_hits += __atomic_load_n(&s->ttable_hits, __ATOMIC_RELAXED);
+		out->ttable_misses += __atomic_load_n(&s->ttable_misses, __ATOMIC_RELAXED);
+		out->ttable_overwrites += __atomic_load_n(&s->ttable_overwrites, __ATOMIC_RELAXED);
+	}
 }
 
 // Compute the amount of time to spend on the next move
@@ -33,21 +96,8 @@ int time_use(board *b, int time_left, int increment, int movestogo) {
 	// http://facta.junis.ni.ac.rs/acar/acar200901/acar2009-07.pdf
 	// Slightly more aggresive time managment because of overhead after search
 
-	// Calculate the total value of material
-	int mat_value = 0;
-	for (int i = 0; i < 8; i++) {
-		for (int j = 0; j < 8; j++) {
-			if (p_eq(b->b[i][j], no_piece)) continue;
-			switch(b->b[i][j].type) {
-				case 'P': mat_value += 1; break;
-				case 'N': mat_value += 3; break;
-				case 'B': mat_value += 3; break;
-				case 'R': mat_value += 5; break;
-				case 'Q': mat_value += 9; break;
-				default: ;
-			}
-		}
-	}
+	// Scale the incremental game phase onto the 0-78 pawn-unit material total the estimate expects
+	int mat_value = min(b->phase, max_phase) * 78 / max_phase;
 	// Assume the game is 70 moves long, but never use more than 1/10th of the remaining time
 	int half_moves_left_guess;
 	if (mat_value < 20) half_moves_left_guess = mat_value + 10;
@@ -55,48 +105,206 @@ int time_use(board *b, int time_left, int increment, int movestogo) {
 	else half_moves_left_guess = (mat_value * 5 - 120) / 4;
 	half_moves_left_guess += 6; // Adjustment for search invocation overhead
 	int our_moves_left_guess = max(5, (half_moves_left_guess / 2));
-	return time_left/our_moves_left_guess;
+	if (movestogo > 0) our_moves_left_guess = min(our_moves_left_guess, movestogo);
+	int budget = time_left/our_moves_left_guess;
+	if (increment > 0) budget += increment * 3 / 4;
+	return min(budget, time_left);
+}
+
+void time_init(timeman *tm, board *b, int time_left, int increment, int movestogo, int movetime) {
+	gettimeofday(&tm->start, NULL);
+	tm->last_best = no_move;
+	tm->last_score = 0;
+	tm->stable_iterations = 0;
+	tm->last_iteration_ms = 0;
+	tm->dominance_checked = false;
+	tm->pondering = false;
+	tm->fixed = (movetime > 0);
+	tm->enabled = tm->fixed || time_left > 0;
+	if (!tm->enabled) return;
+	tm->root_moves = count_legal_moves(b);
+	if (tm->fixed) {
+		tm->soft_ms = tm->hard_ms = max(1, movetime - move_overhead_ms);
+		return;
+	}
+	int usable = max(1, time_left - move_overhead_ms);
+	int soft = time_use(b, usable, increment, movestogo);
+	int hard = min((int) (soft * hard_limit_scale), (int) (usable * hard_limit_max_fraction));
+	tm->hard_ms = max(1, max(hard, min(soft, usable)));
+	tm->soft_ms = min(soft, tm->hard_ms);
+}
+
+double time_elapsed(timeman *tm) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	double elapsed = (now.tv_sec - tm->start.tv_sec) * 1000.0; // sec to ms
+	elapsed += (now.tv_usec - tm->start.tv_usec) / 1000.0; // us to ms
+	return elapsed;
 }
 
-void search(board *b, int ply) {
-	clear_stats(); // Stats for search
-	sstats.depth = ply;
+void time_ponderhit(timeman *tm) {
+	gettimeofday(&tm->start, NULL);
+	tm->pondering = false;
+}
+
+// Decide whether to begin another iteration.
+// Never starts an iteration that is not expected to finish before the hard limit; otherwise
+// compares the elapsed time to the soft target, scaled by how settled the search looks.
+bool time_stop_iterating(timeman *tm, search_context *ctx, board *b, int depth, move best, int score, double iteration_ms) {
+	if (!tm->enabled) return false;
+	double elapsed = time_elapsed(tm);
+	bool best_changed = depth > 1 && !m_eq(best, tm->last_best);
+	bool score_falling = depth > 1 && tm->last_score - score >= falling_score_margin;
+	if (m_eq(best, tm->last_best)) tm->stable_iterations++;
+	else tm->stable_iterations = 0;
+
+	// Estimate the next iteration from the growth of the last two
+	double branching = default_branching_factor;
+	if (tm->last_iteration_ms >= 1) branching = fmin(8.0, fmax(1.5, iteration_ms / tm->last_iteration_ms));
+	double predicted = iteration_ms * branching;
+	tm->last_iteration_ms = iteration_ms;
+	tm->last_best = best;
+	tm->last_score = score;
+
+	if (tm->pondering) return false; // Thinking on the opponent's time is free
+	if (elapsed + predicted > tm->hard_ms) return true; // It could not finish anyway
+	if (tm->fixed) return false;
+	if (tm->root_moves == 1) return true; // Forced move
+
+	double scale = 1.0;
+	if (best_changed) scale *= unstable_move_time_scale;
+	if (score_falling) scale *= falling_score_time_scale;
+	if (tm->stable_iterations >= stable_iterations_threshold) scale *= stable_move_time_scale;
+	double target = fmin(tm->soft_ms * scale, tm->hard_ms);
+	if (elapsed >= target) return true;
+
+	// Stop early if a reduced-depth search shows every alternative is clearly worse
+	if (!tm->dominance_checked && depth >= dominance_min_depth && tm->stable_iterations >= 2
+		&& elapsed >= target * dominance_check_fraction) {
+		tm->dominance_checked = true;
+		if (root_move_dominates(ctx, b, best, score, depth / 2)) return true;
+	}
+	return false;
+}
+
+// Counts the moves at the root that do not leave the king in check.
+int count_legal_moves(board *b) {
+	int num_moves;
+	int legal = 0;
+	move *moves = board_moves(b, &num_moves, false);
+	for (int i = 0; i < num_moves; i++) {
+		apply(b, moves[i]);
+		coord king_loc = b->black_to_move ? b->white_king : b->black_king; // for side that just moved
+		if (!in_check(b, king_loc.col, king_loc.row, !(b->black_to_move))) legal++;
+		unapply(b, moves[i]);
+	}
+	free(moves);
+	return legal;
+}
+
+// Null-window searches every root move except the best one to see if any of them
+// reaches within dominance_margin of the best score.
+bool root_move_dominates(search_context *ctx, board *b, move best, int score, int ply) {
+	int threshold = score - dominance_margin;
+	int num_moves;
+	bool dominates = true;
+	move *moves = board_moves(b, &num_moves, false);
+	for (int i = 0; i < num_moves && dominates; i++) {
+		if (m_eq(moves[i], best)) continue;
+		apply(b, moves[i]);
+		coord king_loc = b->black_to_move ? b->white_king : b->black_king; // for side that just moved
+		if (!in_check(b, king_loc.col, king_loc.row, !(b->black_to_move))) {
+			coord opp_king_loc = b->black_to_move ? b->black_king : b->white_king;
+			bool opponent_in_check = in_check(b, opp_king_loc.col, opp_king_loc.row, b->black_to_move);
+			int alt = -abq(ctx, b, -threshold, -threshold + 1, ply - 1, 0, true, opponent_in_check);
+			if (alt >= threshold) dominates = false;
+		}
+		unapply(b, moves[i]);
+	}
+	free(moves);
+	return dominates && !ctx->terminate_requested;
+}
+
+void search(search_context *ctx, board *b, int ply) {
+	nnue_reset(b); // The accumulator stack is rooted at the position being searched
+	clear_stats(ctx); // Stats for search
+	set_stats_progress(ctx, ply, 0);
+	ctx->root_ply = b->last_move_ply;
 	// Start timer for the search
 	struct timeval t1, t2;
    	gettimeofday(&t1, NULL);
    	int result;
-	if (use_mtd_f) result = mtd_f(b, ply);
+	if (use_mtd_f) result = mtd_f(ctx, b, ply);
 	else {
 		coord king_loc = b->black_to_move ? b->black_king : b->white_king;
 		bool side_to_move_in_check = in_check(b, king_loc.col, king_loc.row, b->black_to_move);
-		result = abq(b, NEG_INFINITY, POS_INFINITY, ply, 0, true, side_to_move_in_check);
+		result = abq(ctx, b, NEG_INFINITY, POS_INFINITY, ply, 0, true, side_to_move_in_check);
 	}
 	gettimeofday(&t2, NULL);
 	// Compute and print the elapsed time in millisec
 	double search_millisec = (t2.tv_sec - t1.tv_sec) * 1000.0; // sec to ms
 	search_millisec += (t2.tv_usec - t1.tv_usec) / 1000.0; // us to ms
-	sstats.time = search_millisec;
+	set_stats_progress(ctx, ply, search_millisec);
 }
 
-int mtd_f(board *board, int ply) {
+int search_multipv(search_context *ctx, board *b, int ply, int num_lines, pvline *lines) {
+	nnue_reset(b);
+	clear_stats(ctx);
+	set_stats_progress(ctx, ply, 0);
+	ctx->root_ply = b->last_move_ply;
+	struct timeval t1, t2;
+	gettimeofday(&t1, NULL);
+	num_lines = min(num_lines, min(count_legal_moves(b), MAX_PV_LENGTH));
+	int found = 0;
+	// Every line shares the transposition table with the lines before it, so the later
+	// re-searches are mostly table hits; the previous iteration's scores are the first guesses.
+	for (int k = 0; k < num_lines; k++) {
+		int guess = lines[k].length > 0 ? lines[k].score : relative_evaluation(b);
+		int score = (k == 0) ? mtd_f(ctx, b, ply) : mtd_f_guess(ctx, b, ply, guess);
+		if (ctx->terminate_requested || ctx->pv_length[0] == 0) break;
+		lines[k].score = score;
+		lines[k].length = ctx->pv_length[0];
+		memcpy(lines[k].moves, ctx->pv_table[0], sizeof(move) * ctx->pv_length[0]);
+		ctx->root_excluded[ctx->root_excluded_count++] = ctx->pv_table[0][0];
+		found++;
+	}
+	ctx->root_excluded_count = 0;
+	// Inconsistent re-searches can leave a later line scoring higher; keep the output ordered
+	for (int k = 1; k < found; k++) {
+		for (int j = k; j > 0 && lines[j].score > lines[j - 1].score; j--) {
+			pvline temp = lines[j];
+			lines[j] = lines[j - 1];
+			lines[j - 1] = temp;
+		}
+	}
+	gettimeofday(&t2, NULL);
+	set_stats_progress(ctx, ply, (t2.tv_sec - t1.tv_sec) * 1000.0 + (t2.tv_usec - t1.tv_usec) / 1000.0);
+	return found;
+}
+
+int mtd_f(search_context *ctx, board *board, int ply) {
 	int g; // First guess of evaluation
 	evaluation stored;
-	tt_get(board, &stored); // Use last pass in Transposition Table
+	tt_get(ctx, board, &stored); // Use last pass in Transposition Table
 	if (!e_eq(stored, no_eval)) g = stored.score; // If not present, use static evaluation as guess
 	else {
 		g = evaluate(board);
 		if (board->black_to_move) g = -g;
 	}
+	return mtd_f_guess(ctx, board, ply, g);
+}
+
+int mtd_f_guess(search_context *ctx, board *board, int ply, int g) {
 	int upper_bound = POS_INFINITY;
 	int lower_bound = NEG_INFINITY;
 	coord king_loc = board->black_to_move ? board->black_king : board->white_king;
 	bool side_to_move_in_check = in_check(board, king_loc.col, king_loc.row, board->black_to_move);
 	while (lower_bound < upper_bound) {
-		if (search_terminate_requested) return 0;
+		if (ctx->terminate_requested) return 0;
 		int beta;
 		if (g == lower_bound) beta = g+1;
 		else beta = g;
-		g = abq(board, beta-1, beta, ply, 0, true, side_to_move_in_check);
+		g = abq(ctx, board, beta-1, beta, ply, 0, true, side_to_move_in_check);
 		if (g < beta) upper_bound = g;
 		else lower_bound = g;
 	}
@@ -129,26 +337,45 @@ int mtd_f(board *board, int ply) {
 
 void *abq_multithread_entrypoint(void *param) {
 	search_worker_thread_args *args = param;
-	int res = abq(args->b, args->alpha, args->beta, args->ply, args->centiply_extension, args->allow_extensions, args->side_to_move_in_check);
+	int res = abq(args->ctx, args->b, args->alpha, args->beta, args->ply, args->centiply_extension, args->allow_extensions, args->side_to_move_in_check);
 	free(args->b);
 	free(param);
 	return res;
 }
 
 // Unified alpha-beta and quiescence search
-int abq(board *b, int alpha, int beta, int ply, int centiply_extension, bool allow_extensions, bool side_to_move_in_check) {
-	if (search_terminate_requested) return 0; // Check for search termination
+int abq(search_context *ctx, board *b, int alpha, int beta, int ply, int centiply_extension, bool allow_extensions, bool side_to_move_in_check) {
+	if (ctx->terminate_requested) return 0; // Check for search termination
 
 	int alpha_orig = alpha; // For use in later TT storage
+	int height = b->last_move_ply - ctx->root_ply; // distance from the root
+	if (height >= MAX_SEARCH_HEIGHT - 1) return relative_evaluation(b); // Out of move lists
+	if (height < MAX_PV_LENGTH) ctx->pv_length[height] = 0;
+	// With root moves excluded, the root's score is not the position's score; keep it out of the TT
+	bool excluding = (height == 0 && ctx->root_excluded_count > 0);
 
 	// Retrieve the value from the transposition table, if appropriate
 	evaluation stored;
-	tt_get(b, &stored);
-	if (!e_eq(stored, no_eval) && stored.depth >= ply && use_ttable) {
-		if (stored.type == qexact || stored.type == exact) return stored.score;
+	tt_get(ctx, b, &stored);
+	if (use_tt_telemetry) tt_telemetry_probe(ctx, ply, stored);
+	if (!e_eq(stored, no_eval) && stored.depth >= ply && use_ttable && !excluding) {
+		bool cutoff = (stored.type == qexact || stored.type == exact);
 		if (stored.type == qlowerbound || stored.type == lowerbound) alpha = max(alpha, stored.score);
 		else if (stored.type == qupperbound || stored.type == upperbound) beta = min(beta, stored.score);
-		if (alpha >= beta) return stored.score;
+		if (cutoff || alpha >= beta) {
+			// The line ends here, with the table's move for this node
+			if (height < MAX_PV_LENGTH && !m_eq(stored.best, no_move)) {
+				ctx->pv_table[height][0] = stored.best;
+				ctx->pv_length[height] = 1;
+			}
+			return stored.score;
+		}
+	}
+
+	// With few enough pieces left, the tablebases know the result
+	if (use_syzygy && height > 0 && ply > 0) {
+		int wdl;
+		if (tb_probe_wdl(b, &wdl)) return tb_wdl_score(wdl, height);
 	}
 
 	// Futility pruning: enter quiescence early if the node is futile
@@ -159,47 +386,33 @@ int abq(board *b, int alpha, int beta, int ply, int centiply_extension, bool all
 	}
 
 	bool quiescence = (ply <= 0);
+	// In check, quiescence searches every evasion instead of standing pat, so that the checks
+	// it tries can be refuted (or found to mate)
+	bool evading = quiescence && side_to_move_in_check && use_qsearch_checks;
 
-	// Generate all possible moves for the quiscence search or normal search, and compute the
-	// static evaluation if applicable.
-	move *moves = NULL;
-	int num_available_moves = 0;
-	if (quiescence) moves = board_moves(b, &num_available_moves, true); // Generate only captures
-	else moves = board_moves(b, &num_available_moves, false); // Generate all moves
-	if (quiescence && !use_qsearch) {
-		free(moves);
-		return relative_evaluation(b); // If qsearch is turned off
-	}
+	if (quiescence && !use_qsearch) return relative_evaluation(b); // If qsearch is turned off
 
 	// Abort if the quiescence search is too deep (currently 45 plies)
 	if (ply < -quiesce_ply_cutoff) { 
-		sstats.qnode_aborts++;
-		free(moves);
+		stat_add(&ctx->stats.qnode_aborts, 1);
 		return relative_evaluation(b);
 	}
 
-	int quiescence_stand_pat;
-	// Allow the quiescence search to generate cutoffs
-	if (quiescence) {
+	// Allow the quiescence search to generate cutoffs before any moves are generated
+	int quiescence_stand_pat = NEG_INFINITY;
+	if (quiescence && !evading) {
 		quiescence_stand_pat = relative_evaluation(b);
 		alpha = max(alpha, quiescence_stand_pat);
-		if (alpha >= beta) {
-			free(moves);
-			return quiescence_stand_pat;
-		}
-	} else if (!e_eq(stored, no_eval) && use_tt_move_hueristic) {
-		assert(is_legal_move(b, stored.best)); // TODO
-		// For non-quiescence search, use the TT entry as a hueristic
-		moves[num_available_moves] = stored.best;
-		num_available_moves++;
+		if (alpha >= beta) return quiescence_stand_pat;
 	}
 
-	// Update search stats
-	if (quiescence) sstats.qnodes_searched++;
-	else sstats.nodes_searched++;
+	// For non-quiescence search, the TT entry's move is searched before any moves are generated
+	move tt_move = no_move;
+	if (!quiescence && !e_eq(stored, no_eval) && use_tt_move_hueristic && is_pseudo_legal(b, stored.best)) tt_move = stored.best;
 
-	// Search hueristic: sort exchanges using MVV-LVA
-	if (quiescence && mvvlva) nlopt_qsort_r(moves, num_available_moves, sizeof(move), b, &capture_move_comparator);
+	// Update search stats
+	if (quiescence) stat_add(&ctx->stats.qnodes_searched, 1);
+	else stat_add(&ctx->stats.nodes_searched, 1);
 
 	// Search extensions
 	bool no_more_extensions = false;
@@ -227,12 +440,51 @@ int abq(board *b, int alpha, int beta, int ply, int centiply_extension, bool all
 	int best_score_yet = NEG_INFINITY; 
 	int num_moves_actually_examined = 0; // We might end up in checkmate
 	//for (int iterations = 0; iterations < 2; iterations++) { // ABDADA iterations
+	// Phase 0 searches the TT move alone; phase 1 generates the rest only if it did not cut off
+	for (int phase = m_eq(tt_move, no_move) ? 1 : 0; phase < 2 && alpha < beta; phase++) {
+		move *moves = ctx->moves[height];
+		int num_available_moves = 0;
+		if (phase == 0) {
+			moves[num_available_moves++] = tt_move;
+		} else if (quiescence && !evading && ply == 0 && use_qsearch_checks) {
+			// Standing pat was not enough, so the first quiescence ply also tries quiet checks
+			board_moves_into(b, moves, &num_available_moves, false);
+			num_available_moves = filter_captures_and_checks(b, moves, num_available_moves);
+		} else {
+			board_moves_into(b, moves, &num_available_moves, quiescence && !evading); // Only captures in quiescence
+		}
+
+		if (phase == 1 && !quiescence) {
+			// Quiet moves that caused cutoffs elsewhere go first, after captures
+			order_moves(ctx, b, moves, num_available_moves);
+			// The TT move was already searched; drop it, keeping the order of the rest
+			if (!m_eq(tt_move, no_move)) {
+				int kept = 0;
+				for (int i = 0; i < num_available_moves; i++) {
+					if (!m_eq(moves[i], tt_move)) moves[kept++] = moves[i];
+				}
+				num_available_moves = kept;
+			}
+		}
+
+		// Search hueristic: sort exchanges using MVV-LVA
+		if (quiescence && mvvlva) nlopt_qsort_r(moves, num_available_moves, sizeof(move), b, &capture_move_comparator);
+
 		for (int i = num_available_moves - 1; i >= 0; i--) { // Iterate backwards to match MVV-LVA sort order
+			if (excluding && move_arr_contains(ctx->root_excluded, moves[i], ctx->root_excluded_count)) continue;
+			// Delta pruning: skip captures that cannot raise alpha even with a margin to spare
+			if (use_delta_pruning && quiescence && !evading && p_eq(moves[i].promote_to, no_piece)) {
+				int gain = 0;
+				if (moves[i].en_passant_capture) gain = piece_value('P');
+				else if (!p_eq(moves[i].captured, no_piece)) gain = piece_value(moves[i].captured.type);
+				if (gain > 0 && quiescence_stand_pat + gain + delta_pruning_margin <= alpha) continue;
+			}
 			/*int claimed_node_id = -1;
 			if (i != num_available_moves - 1 && iterations == 1) { // Skip redundant young brothers on the first pass
 				if (!tt_try_to_claim_node(b, &claimed_node_id)) continue; // Skip the node if it is already being searched
 			} else tt_always_claim_node(b, &claimed_node_id);*/
 			apply(b, moves[i]);
+			if (use_ttable && use_tt_prefetch) tt_prefetch(ctx->tt, b->hash); // Overlaps the legality checks
 			bool we_moved_into_check;
 			// Choose the more efficient version if possible
 			// If we were already in check, we need to do the expensive search
@@ -249,36 +501,43 @@ int abq(board *b, int alpha, int beta, int ply, int centiply_extension, bool all
 			bool opponent_in_check = puts_in_check(b, moves[i], b->black_to_move);
 			/*coord opp_king_loc = b->black_to_move ? b->black_king : b->white_king;
 			bool opponent_in_check = in_check(b, opp_king_loc.col, opp_king_loc.row, (b->black_to_move));*/
-			int score = -abq(b, -beta, -alpha, ply - 1, centiply_extension, allow_extensions, opponent_in_check);
+			int score = -abq(ctx, b, -beta, -alpha, ply - 1, centiply_extension, allow_extensions, opponent_in_check);
 			num_moves_actually_examined++;
 			unapply(b, moves[i]);
 			if (score > best_score_yet) {
 				best_score_yet = score;
 				best_move_yet = moves[i];
+				update_pv(ctx, height, moves[i]);
 			}
 			alpha = max(alpha, best_score_yet);
 			if (alpha >= beta) {
+				if (!quiescence) update_history(ctx, b, moves[i], ply);
 				//tt_unclaim_node(claimed_node_id);
 				break;
 			}
 			//tt_unclaim_node(claimed_node_id);
 		}
+	}
 	//}
-	free(moves); // We are done with the array
 
 	// We have no available moves (or captures) that don't leave us in check
 	// This means checkmate or stalemate in normal search
 	// It might mean no captures are available in quiescence search
 	if (num_moves_actually_examined == 0) {
-		if (quiescence) return quiescence_stand_pat; // TODO: qsearch doesn't understand stalemate or checkmate
+		if (evading) return NEG_INFINITY + 1; // checkmate
+		if (quiescence) return quiescence_stand_pat; // TODO: qsearch doesn't understand stalemate
 		// This seems paradoxical, but the +1 is necessary so we pick some move in case of checkmate
 		if (currently_in_check) return NEG_INFINITY + 1; // checkmate
 		else return 0; // stalemate
 	}
 
-	if (quiescence && best_score_yet < quiescence_stand_pat) return quiescence_stand_pat; // TODO experimental stand pat
+	if (quiescence && best_score_yet < quiescence_stand_pat) { // TODO experimental stand pat
+		if (height < MAX_PV_LENGTH) ctx->pv_length[height] = 0;
+		return quiescence_stand_pat;
+	}
 
-	if (search_terminate_requested) return 0; // Search termination preempts tt_put
+	if (ctx->terminate_requested) return 0; // Search termination preempts tt_put
+	if (excluding) return best_score_yet;
 
 	// Record the selected move in the transposition table
 	evaltype type;
@@ -286,10 +545,68 @@ int abq(board *b, int alpha, int beta, int ply, int centiply_extension, bool all
 	else if (best_score_yet >= beta) type = (quiescence) ? qlowerbound : lowerbound;
 	else type = (quiescence) ? qexact : exact;
 	evaluation eval = {.best = best_move_yet, .score = best_score_yet, .type = type, .depth = ply};
-	tt_put(b, eval);
+	tt_put(ctx, b, eval);
 	return best_score_yet;
 }
 
+// Sorts moves so that the most promising is last, matching the backwards iteration in abq:
+// captures by MVV-LVA, then quiet moves by history.
+void order_moves(search_context *ctx, board *b, move *moves, int count) {
+	int scores[MAX_MOVES];
+	int side = b->black_to_move ? 1 : 0;
+	for (int i = 0; i < count; i++) {
+		if (!p_eq(moves[i].captured, no_piece) || !p_eq(moves[i].promote_to, no_piece)) {
+			scores[i] = history_max + capture_score(b, &moves[i]);
+		} else {
+			scores[i] = ctx->history[side][moves[i].from.col * 8 + moves[i].from.row][moves[i].to.col * 8 + moves[i].to.row];
+		}
+	}
+	for (int i = 1; i < count; i++) { // insertion sort; lists are short
+		move m = moves[i];
+		int score = scores[i];
+		int j = i - 1;
+		for (; j >= 0 && scores[j] > score; j--) {
+			moves[j + 1] = moves[j];
+			scores[j + 1] = scores[j];
+		}
+		moves[j + 1] = m;
+		scores[j + 1] = score;
+	}
+}
+
+// Credit a quiet move that caused a cutoff, weighted by remaining depth.
+void update_history(search_context *ctx, board *b, move m, int ply) {
+	if (!p_eq(m.captured, no_piece) || !p_eq(m.promote_to, no_piece) || m.en_passant_capture || ply <= 0) return;
+	int side = b->black_to_move ? 1 : 0;
+	int *entry = &ctx->history[side][m.from.col * 8 + m.from.row][m.to.col * 8 + m.to.row];
+	*entry += ply * ply;
+	if (*entry >= history_max) { // Age the whole table so it keeps adapting
+		for (int i = 0; i < 2 * 64 * 64; i++) ((int *) ctx->history)[i] /= 2;
+	}
+}
+
+// Keeps captures, promotions and moves that give check at the front of the list.
+// Returns the new count.
+int filter_captures_and_checks(board *b, move *moves, int count) {
+	int kept = 0;
+	for (int i = 0; i < count; i++) {
+		bool keep = !p_eq(moves[i].captured, no_piece) || !p_eq(moves[i].promote_to, no_piece) 
+			|| moves[i].en_passant_capture;
+		if (!keep) keep = gives_check(b, moves[i]);
+		if (keep) moves[kept++] = moves[i];
+	}
+	return kept;
+}
+
+// Make m followed by the child's line the principal variation of the node at height.
+void update_pv(search_context *ctx, int height, move m) {
+	if (height >= MAX_PV_LENGTH) return;
+	ctx->pv_table[height][0] = m;
+	int child_length = (height + 1 < MAX_PV_LENGTH) ? ctx->pv_length[height + 1] : 0;
+	if (child_length > 0) memcpy(ctx->pv_table[height] + 1, ctx->pv_table[height + 1], sizeof(move) * child_length);
+	ctx->pv_length[height] = child_length + 1;
+}
+
 /* 
  * Returns a relative evaluation of the board position from the perspective of the side about to move.
  */
@@ -299,6 +616,31 @@ int relative_evaluation(board *b) {
 	return evaluation;
 }
 
+// MVV-LVA value of a capture: higher is better.
+int capture_score(const board *board, const move *m) {
+	int victim_value;
+	switch(m->captured.type) {
+		case 'P': victim_value = 1; break;
+		case 'N': victim_value = 3; break;
+		case 'B': victim_value = 3; break;
+		case 'R': victim_value = 5; break;
+		case 'Q': victim_value = 9; break;
+		case 'K': victim_value = 200; break;
+		default: victim_value = 0; // Promotions and en passant
+	}
+	int attacker_value;
+	switch(at(board, m->from).type) {
+		case 'P': attacker_value = 1; break;
+		case 'N': attacker_value = 3; break;
+		case 'B': attacker_value = 3; break;
+		case 'R': attacker_value = 5; break;
+		case 'Q': attacker_value = 9; break;
+		case 'K': attacker_value = 20; break;
+		default: assert(false);
+	}
+	return (victim_value << 2) - attacker_value + 20; // Never negative
+}
+
 // An array sorting comparator for capture moves, for use with qsort_r.
 // Sorts by MVV/LVA (Most Valuable Victim/Least Valuable Attacker) in REVERSE order.
 // Returns -1 if the first argument should come first, etc.
@@ -352,6 +694,8 @@ int capture_move_comparator(const board *board, const move *a, const move *b) {
 } 
 
 void apply(board *b, move m) {
+	nnue_push(b);
+
 	// Disable the old en passant eligibility for a file
 	if (b->en_passant_pawn_push_col_history[b->last_move_ply] != -1) {
 		b->hash ^= zobrist_en_passant_files[b->en_passant_pawn_push_col_history[b->last_move_ply]];
@@ -365,15 +709,28 @@ void apply(board *b, move m) {
 	if (m.en_passant_capture) {
 		uint8_t en_passant_capture_row = moved_piece.white ? 4 : 3;
 		coord en_pasant_capture_square = (coord){b->en_passant_pawn_push_col_history[b->last_move_ply], en_passant_capture_row};
+		b->hash ^= tt_pieceval(b, en_pasant_capture_square);
+		b->pawn_hash ^= tt_pawnval(b, en_pasant_capture_square);
+		eval_square_update(b, en_pasant_capture_square, -1);
+		nnue_record(b, en_pasant_capture_square, -1);
 		set(b, en_pasant_capture_square, no_piece);
 	}
 
 	// Transform board and hash
 	b->hash ^= tt_pieceval(b, m.from);
 	b->hash ^= tt_pieceval(b, m.to);
+	b->pawn_hash ^= tt_pawnval(b, m.from);
+	b->pawn_hash ^= tt_pawnval(b, m.to);
+	eval_square_update(b, m.from, -1);
+	nnue_record(b, m.from, -1);
+	eval_square_update(b, m.to, -1);
+	nnue_record(b, m.to, -1);
 	set(b, m.to, new_piece);
 	set(b, m.from, no_piece);
 	b->hash ^= tt_pieceval(b, m.to);
+	b->pawn_hash ^= tt_pawnval(b, m.to);
+	eval_square_update(b, m.to, 1);
+	nnue_record(b, m.to, 1);
 	b->hash ^= zobrist_black_to_move;
 	b->black_to_move = !b->black_to_move;
 	b->last_move_ply++;
@@ -391,9 +748,13 @@ void apply(board *b, move m) {
 		uint8_t rook_from_col = ((m.c == K) ? 7 : 0);
 		uint8_t rook_to_col = ((m.c == K) ? 5 : 3);
 		b->hash ^= tt_pieceval(b, (coord){rook_from_col, m.from.row});
+		eval_square_update(b, (coord){rook_from_col, m.from.row}, -1);
+		nnue_record(b, (coord){rook_from_col, m.from.row}, -1);
 		b->b[rook_to_col][m.to.row] = (piece){'R', at(b, m.to).white}; // !!
 		b->b[rook_from_col][m.from.row] = no_piece;
 		b->hash ^= tt_pieceval(b, (coord){rook_to_col, m.to.row});
+		eval_square_update(b, (coord){rook_to_col, m.to.row}, 1);
+		nnue_record(b, (coord){rook_to_col, m.to.row}, 1);
 	}
 
 	// King moves always strip castling rights
@@ -450,6 +811,8 @@ void apply(board *b, move m) {
 }
 
 void unapply(board *b, move m) {
+	nnue_pop(b);
+
 	// Information
 	piece old_piece = p_eq(m.promote_to, no_piece) ? at(b, m.to) : (piece){'P', at(b, m.to).white};
 
@@ -460,10 +823,16 @@ void unapply(board *b, move m) {
 
 	// Transform board and hash
 	b->hash ^= tt_pieceval(b, m.to);
+	b->pawn_hash ^= tt_pawnval(b, m.to);
+	eval_square_update(b, m.to, -1);
 	set(b, m.from, old_piece);
 	set(b, m.to, m.captured);
 	b->hash ^= tt_pieceval(b, m.from);
 	b->hash ^= tt_pieceval(b, m.to);
+	b->pawn_hash ^= tt_pawnval(b, m.from);
+	b->pawn_hash ^= tt_pawnval(b, m.to);
+	eval_square_update(b, m.from, 1);
+	eval_square_update(b, m.to, 1);
 	b->hash ^= zobrist_black_to_move;
 	b->black_to_move = !b->black_to_move;
 	b->last_move_ply--;
@@ -479,6 +848,9 @@ void unapply(board *b, move m) {
 		coord en_pasant_capture_square = (coord){b->en_passant_pawn_push_col_history[b->last_move_ply], en_passant_capture_row};
 		piece captured_pawn = (piece) {'P', !old_piece.white};
 		set(b, en_pasant_capture_square, captured_pawn);
+		b->hash ^= tt_pieceval(b, en_pasant_capture_square);
+		b->pawn_hash ^= tt_pawnval(b, en_pasant_capture_square);
+		eval_square_update(b, en_pasant_capture_square, 1);
 	}
 
 	if (old_piece.type == 'K') {
@@ -491,9 +863,11 @@ void unapply(board *b, move m) {
 		uint8_t rook_to_col = ((m.c == K) ? 7 : 0);
 		uint8_t rook_from_col = ((m.c == K) ? 5 : 3);
 		b->hash ^= tt_pieceval(b, (coord){rook_from_col, m.from.row});
+		eval_square_update(b, (coord){rook_from_col, m.from.row}, -1);
 		b->b[rook_to_col][m.to.row] = (piece){'R', at(b, m.from).white};
 		b->b[rook_from_col][m.from.row] = no_piece;
 		b->hash ^= tt_pieceval(b, (coord){rook_to_col, m.to.row});
+		eval_square_update(b, (coord){rook_to_col, m.to.row}, 1);
 	}
 
 	// Restore castling rights
@@ -16,6 +16,8 @@
 #include "types.h"
 #include "util.h"
 #include "evaluate.h"
+#include "nnue.h"
+#include "tbprobe.h"
 #include "movegen.h"
 
 /*
@@ -30,22 +32,41 @@ static const coord bkr = (coord) {7, 7};
 static const int POS_INFINITY = 9999;
 static const int NEG_INFINITY = -9999;
 
-/*
- * Search statistics
- */
- extern searchstats sstats;
-
 /*
  * Public API
  */
+// Allocate a search context. Pass a table to share it with other contexts, or NULL for the
+// context to create and own a table of tt_megabytes.
+search_context *search_context_create(ttable *shared_tt);
+void search_context_destroy(search_context *ctx);
+// Forget what the context learned about move ordering, e.g. for a new game
+void search_context_clear(search_context *ctx);
 // Clear the search stats struct, for use between search() calls
-void clear_stats(void);
+void clear_stats(search_context *ctx);
+// Sum the stats of contexts searching together; safe to call from another thread mid-search
+void stats_snapshot(search_context **contexts, int count, searchstats *out);
 // Computes how much time should be used to search the next move, all units in ms
 int time_use(board *b, int time_left, int increment, int movestogo);
+// Starts the clock and computes the soft and hard limits for the next move
+// Parameters might be -1 if they do not apply; the manager is disabled if no limit applies
+void time_init(timeman *tm, board *b, int time_left, int increment, int movestogo, int movetime);
+// Milliseconds since time_init, or since time_ponderhit
+double time_elapsed(timeman *tm);
+// The opponent played the expected move; start the clock for the running search
+void time_ponderhit(timeman *tm);
+// Called after each completed iteration; returns true if no further iteration should be started
+bool time_stop_iterating(timeman *tm, search_context *ctx, board *b, int depth, move best, int score, double iteration_ms);
 // Perform a search and store the results in the transposition table
-void search(board *b, int ply);
+void search(search_context *ctx, board *b, int ply);
+// Search for the best num_lines root moves, each excluding the ones before it, and store their
+// scores and principal variations in best-first order. Returns the number of lines found.
+int search_multipv(search_context *ctx, board *b, int ply, int num_lines, pvline *lines);
+// Counts the moves that do not leave the king in check
+int count_legal_moves(board *b);
 // Apply and unapply a move to the board, updating the hash
 void apply(board *b, move m);
 void unapply(board *b, move m);
+// MVV-LVA value of a capture or promotion; higher is better
+int capture_score(const board *board, const move *m);
 
 #endif
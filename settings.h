@@ -15,9 +15,13 @@ static const bool use_mtd_f = true; // Use MTD-F optimization on top of alpha-be
 static const int quiesce_ply_cutoff = 45; // Quiescence search will cut off after this many plies
 #define mvvlva true // Capture hueristic
 #define use_qsearch true // Quiescence search
+#define use_qsearch_checks true // Quiet checks on the first quiescence ply, and evasions when in check
+#define use_delta_pruning true // Skip quiescence captures that cannot raise alpha
+static const int delta_pruning_margin = 200; // Positional slack allowed on top of the captured piece
 static const bool clear_tt_every_move = false; // Clear the transposition table after each search completes
 #define use_ttable true // Should the transposition table be used to generate search cutoffs?
-#define use_hash_option false // Allow the uci interface to set the tt size
+#define use_hash_option true // Allow the uci interface to set the tt size
+static const bool use_tt_prefetch = true; // Prefetch a child's table entry as soon as its hash is known
 static const bool use_tt_move_hueristic = true; // Use the last move stored in the TT as a "best-first" hueristic
 static const bool check_extend = false; // Extend the search by one ply in case of check
 static const int check_extension_centiply = 100; // Centiply to extend in case of check
@@ -28,20 +32,63 @@ static const bool always_use_debug_mode = false;
 static const int frontier_futility_margin = 310;
 static const int prefrontier_futility_margin = 510;
 #define use_futility_pruning true
+static const int history_max = 1 << 20; // History scores are halved when one reaches this
 
 /*
  * Evaluation settings
  */
 static const int doubled_pawn_penalty = 13; // Evaluation penalties for doubled pawns
 static const int bishop_pair_bonus = 20;
+#define use_eval_cache true // Remember recent static evaluations by Zobrist hash
+#define eval_cache_bits 18 // 2^18 entries of 8 bytes each (2MB), shared by all threads
+#define debug_incremental_eval false // Check the incremental material and PST sums against a full rescan
+#define use_pawn_hash true // Cache pawn structure by pawn Zobrist hash
+#define pawn_hash_bits 14 // 2^14 entries of 16 bytes each (256KB), shared by all threads
+#define use_endgame_evaluators true // Specialized evaluation of KPK, KRK, KQK, KBNK and drawn endings
+static const int known_win_score = 1000; // Bonus for an ending known to be won, on top of material
+
+/*
+ * Opening book settings
+ */
+#define own_book_default false // Play from the book set by BookFile; the OwnBook option overrides
+#define book_pick_best false // Always play the most heavily weighted book move, not a weighted draw
+
+/*
+ * Tablebase settings
+ */
+#define use_syzygy true // Probe Syzygy tables once the SyzygyPath option is set
+#define syzygy_probe_limit_default 7 // Most pieces, kings included, for a probe; 7 is the largest table
+static const int tb_win_score = 5000; // Score of a tablebase win, less one per ply from the root
 
 /*
  * Transposition Table settings
  */
-#define TT_MEGABYTES_DEFAULT 1000
-static const double tt_max_load = .70;
-// Nodes that haven't been accessed in this many moves are ancient and might be removed
+#define TT_MEGABYTES_DEFAULT 1024 // in MiB; rounded down to a power of two buckets
+#define keep_hash_on_resize_default false // Move the entries to the new table when Hash changes
+static const uint64_t zobrist_seed = 0x9E3779B97F4A7C15ULL; // Fixed, so saved tables stay valid across runs
+// Nodes that haven't been accessed in this many searches are ancient and are replaced first
 static const int remove_at_age = 3; // TODO dynamically select?
+static const int tt_age_weight = 4; // Depth an entry's worth drops for each search it goes unused
+static const int tt_exact_bonus = 2; // Extra depth an exact entry's worth counts for
+#define use_tt_huge_pages true // Ask the OS to back the table with transparent huge pages
+static const int tt_clear_threads_max = 8; // Most threads that zero the table at once
+#define use_tt_telemetry false // Count probe positions, collisions, replacements and hits by depth
+
+/*
+ * Time management settings
+ */
+static const int move_overhead_ms = 30; // Reserved per move for GUI and communication lag
+static const double hard_limit_scale = 3.0; // The hard limit is this multiple of the soft target...
+static const double hard_limit_max_fraction = 0.2; // ...but never more than this share of the clock
+static const double default_branching_factor = 4.0; // Guess for next iteration time / last iteration time
+static const double unstable_move_time_scale = 1.6; // Extend when the best move just changed
+static const double falling_score_time_scale = 1.3; // Extend when the score dropped by...
+static const int falling_score_margin = 30; // ...at least this many centipawns
+static const int stable_iterations_threshold = 4; // After this many iterations with the same best move...
+static const double stable_move_time_scale = 0.6; // ...shrink the target
+static const int dominance_min_depth = 6; // Check for a dominating root move from this depth...
+static const double dominance_check_fraction = 0.3; // ...once this share of the target is used
+static const int dominance_margin = 150; // Every other move must be this much worse to stop early
 
 /*
  * Engine settings
@@ -56,6 +103,7 @@ static const int remove_at_age = 3; // TODO dynamically select?
 #define max_input_string_length 2000
 #define iterative_deepening_cutoff 40 // Cutoff is necessary to prevent very deep sarches in the event of mate
 #define pv_printing_cutoff 40 // Cutoff is nessary to avoid printing cyclic PVs forever
+#define max_multi_pv 32 // Upper bound for the MultiPV option
 
 #endif
 
@@ -0,0 +1,952 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "tbprobe.h"
+#include "movegen.h"
+#include "search.h"
+
+/*
+ * Squares are numbered row * 8 + col, so a1 = 0, h1 = 7 and h8 = 63. Pieces in the files are
+ * coded 1-6 for white PNBRQK and 9-14 for black, so xor 8 swaps the colors, as xor 56 flips
+ * the board top to bottom and xor 7 left to right.
+ */
+
+#define TB_HASH_BITS 13 // Both material keys of every table, with room to spare
+#define MAX_DTZ (1 << 18)
+
+// Flags of each table; all but SINGLE_VALUE only appear in DTZ tables
+enum { FLAG_STM = 1, FLAG_MAPPED = 2, FLAG_WIN_PLIES = 4, FLAG_LOSS_PLIES = 8, FLAG_WIDE = 16,
+	FLAG_SINGLE_VALUE = 128 };
+
+typedef enum probe_state {
+	PROBE_FAIL,
+	PROBE_OK,
+	PROBE_CHANGE_STM, // a DTZ table holds the other side to move
+	PROBE_ZEROING_BEST_MOVE // the best move is a capture or pawn move, so DTZ is not stored
+} probe_state;
+
+// Decoding information for one subtable: one per side to move, and per leading pawn file
+typedef struct pairs_data {
+	uint8_t flags;
+	uint8_t max_sym_len; // lengths in bits of the Huffman codes
+	uint8_t min_sym_len; // or the value itself, for SINGLE_VALUE
+	uint32_t num_blocks;
+	uint64_t block_size; // bytes per block of compressed data
+	uint64_t span; // values between sparse index entries
+	const uint8_t *lowest_sym; // uint16: lowest symbol of each code length
+	const uint8_t *btree; // 3 bytes per symbol: the two 12-bit symbols it expands to
+	const uint8_t *block_length; // uint16: values stored in each block, less one
+	uint32_t block_length_size;
+	const uint8_t *sparse_index; // 6 bytes per entry: uint32 block and uint16 offset
+	uint64_t sparse_index_size;
+	const uint8_t *data; // compressed blocks
+	uint64_t *base64; // lowest code of each length, left-aligned in 64 bits
+	uint8_t *symlen; // values each symbol expands to, less one
+	uint8_t pieces[TB_MAX_PIECES]; // in encoding order
+	uint64_t group_idx[TB_MAX_PIECES + 1]; // index multiplier of each group
+	int group_len[TB_MAX_PIECES + 1]; // pieces in each group; zero-terminated
+	uint16_t map_idx[4]; // DTZ value maps for wins, losses, cursed wins and blessed losses
+} pairs_data;
+
+typedef struct tb_table {
+	bool dtz;
+	bool ready; // mapped, or found to be unusable; set with release ordering
+	void *base;
+	size_t mapping;
+	const uint8_t *map; // DTZ value maps
+	uint64_t key; // material key with the first side in the name as white
+	uint64_t key2; // and as black
+	int piece_count;
+	bool has_pawns;
+	bool has_unique_pieces; // a non-king piece that is the only one of its kind and color
+	uint8_t pawn_count[2]; // leading color, then the other
+	pairs_data items[2][4]; // [side to move][leading pawn file]
+	char name[TB_MAX_PIECES + 2]; // like KRvK
+} tb_table;
+
+typedef struct tb_entry {
+	uint64_t key;
+	tb_table *wdl;
+	tb_table *dtz;
+} tb_entry;
+
+static tb_entry tb_hash[1 << TB_HASH_BITS];
+static tb_table **tb_tables = NULL; // every table, WDL and DTZ, for freeing
+static int tb_table_count = 0;
+static char tb_paths[max_input_string_length] = "";
+static int tb_largest = 0;
+static int tb_limit = syzygy_probe_limit_default;
+static pthread_mutex_t tb_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Index tables
+ */
+
+static int map_pawns[64]; // a2-h7 to 0..47, highest for the pawn that leads
+static int map_b1h1h7[64]; // squares below the a1-h8 diagonal to 0..27
+static int map_a1d1d4[64]; // the a1-d1-d4 triangle to 0..9, diagonal last
+static int map_kk[10][64]; // the 462 king pairs with the first king in the triangle
+static uint64_t binomial[6][64]; // [k][n]: ways to choose k of n
+static int lead_pawn_idx[6][64]; // [leading pawns][square of the first]
+static int lead_pawns_size[6][4]; // [leading pawns][file]
+
+static inline int off_a1h8(int sq) {
+	return (sq >> 3) - (sq & 7);
+}
+
+static void init_indices(void) {
+	static bool done = false;
+	if (done) return;
+	done = true;
+
+	int code = 0;
+	for (int sq = 0; sq < 64; sq++) {
+		if (off_a1h8(sq) < 0) map_b1h1h7[sq] = code++;
+	}
+
+	int diagonal[4], diagonal_count = 0;
+	code = 0;
+	for (int row = 0; row < 4; row++) {
+		for (int col = 0; col < 4; col++) {
+			int sq = row * 8 + col;
+			if (off_a1h8(sq) < 0) map_a1d1d4[sq] = code++;
+			else if (off_a1h8(sq) == 0) diagonal[diagonal_count++] = sq;
+		}
+	}
+	for (int i = 0; i < diagonal_count; i++) map_a1d1d4[diagonal[i]] = code++;
+
+	// Pairs with both kings on the diagonal come last
+	int both_on_diagonal[64][2], both_count = 0;
+	code = 0;
+	for (int idx = 0; idx < 10; idx++) {
+		for (int s1 = 0; s1 <= 27; s1++) {
+			if (map_a1d1d4[s1] != idx || (idx == 0 && s1 != 1)) continue; // only b1 maps to 0
+			for (int s2 = 0; s2 < 64; s2++) {
+				int col_distance = abs((s1 & 7) - (s2 & 7)), row_distance = abs((s1 >> 3) - (s2 >> 3));
+				if (col_distance <= 1 && row_distance <= 1) continue; // illegal
+				if (off_a1h8(s1) == 0 && off_a1h8(s2) > 0) continue; // mirrored across the diagonal
+				if (off_a1h8(s1) == 0 && off_a1h8(s2) == 0) {
+					both_on_diagonal[both_count][0] = idx;
+					both_on_diagonal[both_count++][1] = s2;
+				} else map_kk[idx][s2] = code++;
+			}
+		}
+	}
+	for (int i = 0; i < both_count; i++) map_kk[both_on_diagonal[i][0]][both_on_diagonal[i][1]] = code++;
+
+	binomial[0][0] = 1;
+	for (int n = 1; n < 64; n++) {
+		for (int k = 0; k < 6 && k <= n; k++) {
+			binomial[k][n] = (k > 0 ? binomial[k - 1][n - 1] : 0) + (k < n ? binomial[k][n - 1] : 0);
+		}
+	}
+
+	// The leading pawn is nearest the edge, and lowest among pawns on the same file
+	int available = 47;
+	for (int lead = 1; lead <= 5; lead++) {
+		for (int col = 0; col < 4; col++) {
+			int idx = 0;
+			for (int row = 1; row <= 6; row++) {
+				int sq = row * 8 + col;
+				if (lead == 1) {
+					map_pawns[sq] = available--;
+					map_pawns[sq ^ 7] = available--;
+				}
+				lead_pawn_idx[lead][sq] = idx;
+				idx += binomial[lead - 1][map_pawns[sq]];
+			}
+			lead_pawns_size[lead][col] = idx;
+		}
+	}
+}
+
+/*
+ * File access
+ */
+
+static inline uint16_t read_le16(const uint8_t *p) {
+	return (uint16_t) (p[0] | (p[1] << 8));
+}
+
+static inline uint32_t read_le32(const uint8_t *p) {
+	return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static inline uint32_t read_be32(const uint8_t *p) {
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+static inline uint64_t read_be64(const uint8_t *p) {
+	return ((uint64_t) read_be32(p) << 32) | read_be32(p + 4);
+}
+
+// Open a table file in the first directory of tb_paths that has it
+static int open_table_file(const char *name, const char *extension) {
+	char paths[max_input_string_length];
+	strncpy(paths, tb_paths, sizeof(paths) - 1);
+	paths[sizeof(paths) - 1] = '\0';
+	char *saveptr;
+	for (char *dir = strtok_r(paths, ":", &saveptr); dir != NULL; dir = strtok_r(NULL, ":", &saveptr)) {
+		char path[max_input_string_length + 32];
+		snprintf(path, sizeof(path), "%s/%s%s", dir, name, extension);
+		int fd = open(path, O_RDONLY);
+		if (fd >= 0) return fd;
+	}
+	return -1;
+}
+
+// Map a table's file and check its magic number; returns the data after it, or NULL
+static const uint8_t *map_table_file(tb_table *e) {
+	static const uint8_t wdl_magic[4] = {0x71, 0xE8, 0x23, 0x5D};
+	static const uint8_t dtz_magic[4] = {0xD7, 0x66, 0x0C, 0xA5};
+	const char *extension = e->dtz ? ".rtbz" : ".rtbw";
+	int fd = open_table_file(e->name, extension);
+	if (fd < 0) return NULL; // DTZ files are optional
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size % 64 != 16) {
+		stdout_fprintf(logstr, "info string corrupt tablebase file %s%s\n", e->name, extension);
+		close(fd);
+		return NULL;
+	}
+	void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		stdout_fprintf(logstr, "info string could not map tablebase file %s%s\n", e->name, extension);
+		return NULL;
+	}
+	madvise(base, st.st_size, MADV_RANDOM); // Probes are scattered; don't read ahead
+	if (memcmp(base, e->dtz ? dtz_magic : wdl_magic, 4) != 0) {
+		stdout_fprintf(logstr, "info string corrupt tablebase file %s%s\n", e->name, extension);
+		munmap(base, st.st_size);
+		return NULL;
+	}
+	e->base = base;
+	e->mapping = st.st_size;
+	return (const uint8_t *) base + 4;
+}
+
+/*
+ * Table setup, on first access
+ */
+
+static inline int sym_left(const pairs_data *d, int sym) {
+	const uint8_t *lr = d->btree + 3 * sym;
+	return ((lr[1] & 0xF) << 8) | lr[0];
+}
+
+static inline int sym_right(const pairs_data *d, int sym) {
+	const uint8_t *lr = d->btree + 3 * sym;
+	return (lr[2] << 4) | (lr[1] >> 4);
+}
+
+static inline pairs_data *subtable(tb_table *e, int stm, int file) {
+	return &e->items[e->dtz ? 0 : stm][e->has_pawns ? file : 0];
+}
+
+// Split the pieces into the groups that are encoded together: the leading pawns or pieces, then
+// runs of identical pieces. The order byte gives the order the groups are multiplied in.
+static void set_groups(tb_table *e, pairs_data *d, const int order[2], int file) {
+	int n = 0, first_len = e->has_pawns ? 0 : e->has_unique_pieces ? 3 : 2;
+	d->group_len[n] = 1;
+	for (int i = 1; i < e->piece_count; i++) {
+		if (--first_len > 0 || d->pieces[i] == d->pieces[i - 1]) d->group_len[n]++;
+		else d->group_len[++n] = 1;
+	}
+	d->group_len[++n] = 0;
+
+	bool pp = e->has_pawns && e->pawn_count[1]; // pawns on both sides
+	int next = pp ? 2 : 1;
+	int free_squares = 64 - d->group_len[0] - (pp ? d->group_len[1] : 0);
+	uint64_t idx = 1;
+	for (int k = 0; next < n || k == order[0] || k == order[1]; k++) {
+		if (k == order[0]) { // leading pawns or pieces
+			d->group_idx[0] = idx;
+			idx *= e->has_pawns ? (uint64_t) lead_pawns_size[d->group_len[0]][file] : e->has_unique_pieces ? 31332 : 462;
+		} else if (k == order[1]) { // the other side's pawns
+			d->group_idx[1] = idx;
+			idx *= binomial[d->group_len[1]][48 - d->group_len[0]];
+		} else {
+			d->group_idx[next] = idx;
+			idx *= binomial[d->group_len[next]][free_squares];
+			free_squares -= d->group_len[next++];
+		}
+	}
+	d->group_idx[n] = idx;
+}
+
+// Symbols expand recursively into pairs of symbols; count the values each one stands for
+static uint8_t set_symlen(pairs_data *d, int sym, bool *visited) {
+	visited[sym] = true;
+	int right = sym_right(d, sym);
+	if (right == 0xFFF) return 0;
+	int left = sym_left(d, sym);
+	if (!visited[left]) d->symlen[left] = set_symlen(d, left, visited);
+	if (!visited[right]) d->symlen[right] = set_symlen(d, right, visited);
+	return d->symlen[left] + d->symlen[right] + 1;
+}
+
+static const uint8_t *set_sizes(pairs_data *d, const uint8_t *data) {
+	d->flags = *data++;
+	if (d->flags & FLAG_SINGLE_VALUE) {
+		d->num_blocks = 0;
+		d->span = 0;
+		d->block_length_size = 0;
+		d->sparse_index_size = 0;
+		d->min_sym_len = *data++; // the value of every position
+		return data;
+	}
+
+	int groups = 0;
+	while (d->group_len[groups] != 0) groups++;
+	uint64_t tb_size = d->group_idx[groups];
+
+	d->block_size = 1ULL << *data++;
+	d->span = 1ULL << *data++;
+	d->sparse_index_size = (tb_size + d->span - 1) / d->span;
+	int padding = *data++;
+	d->num_blocks = read_le32(data);
+	data += 4;
+	d->block_length_size = d->num_blocks + padding; // so the sparse index never points past the end
+	d->max_sym_len = *data++;
+	d->min_sym_len = *data++;
+	d->lowest_sym = data;
+
+	// Canonical Huffman codes: longer codes have lower values, so the left-aligned lowest code
+	// of each length decreases with length, and a code's length is found by comparison
+	int lengths = d->max_sym_len - d->min_sym_len + 1;
+	d->base64 = calloc(lengths, sizeof(uint64_t));
+	for (int i = lengths - 2; i >= 0; i--) {
+		d->base64[i] = (d->base64[i + 1] + read_le16(d->lowest_sym + 2 * i)
+			- read_le16(d->lowest_sym + 2 * (i + 1))) / 2;
+	}
+	for (int i = 0; i < lengths; i++) d->base64[i] <<= 64 - i - d->min_sym_len;
+	data += 2 * lengths;
+
+	int symbols = read_le16(data);
+	data += 2;
+	d->btree = data;
+	d->symlen = calloc(symbols, 1);
+	bool *visited = calloc(symbols, sizeof(bool));
+	for (int sym = 0; sym < symbols; sym++) {
+		if (!visited[sym]) d->symlen[sym] = set_symlen(d, sym, visited);
+	}
+	free(visited);
+	return data + 3 * symbols + (symbols & 1);
+}
+
+// DTZ values are stored as ranks by frequency; the maps give them back
+static const uint8_t *set_dtz_map(tb_table *e, const uint8_t *data, int max_file) {
+	e->map = data;
+	for (int f = 0; f <= max_file; f++) {
+		pairs_data *d = subtable(e, 0, f);
+		if (!(d->flags & FLAG_MAPPED)) continue;
+		if (d->flags & FLAG_WIDE) {
+			data += (uintptr_t) data & 1; // 16-bit aligned
+			for (int i = 0; i < 4; i++) {
+				d->map_idx[i] = (uint16_t) ((data - e->map) / 2 + 1);
+				data += 2 * read_le16(data) + 2;
+			}
+		} else {
+			for (int i = 0; i < 4; i++) {
+				d->map_idx[i] = (uint16_t) (data - e->map + 1);
+				data += *data + 1;
+			}
+		}
+	}
+	return data + ((uintptr_t) data & 1);
+}
+
+static bool setup_table(tb_table *e, const uint8_t *data) {
+	const uint8_t *end = (const uint8_t *) e->base + e->mapping;
+	bool split = (data[0] & 1) != 0, has_pawns = (data[0] & 2) != 0;
+	if (has_pawns != e->has_pawns || (!e->dtz && split != (e->key != e->key2))) return false;
+	data++;
+
+	int sides = (!e->dtz && e->key != e->key2) ? 2 : 1;
+	int max_file = e->has_pawns ? 3 : 0;
+	bool pp = e->has_pawns && e->pawn_count[1];
+
+	for (int f = 0; f <= max_file; f++) {
+		int order[2][2] = {
+			{data[0] & 0xF, pp ? data[1] & 0xF : 0xF},
+			{data[0] >> 4, pp ? data[1] >> 4 : 0xF}
+		};
+		data += 1 + pp;
+		for (int k = 0; k < e->piece_count; k++, data++) {
+			for (int i = 0; i < sides; i++) e->items[i][f].pieces[k] = i ? *data >> 4 : *data & 0xF;
+		}
+		for (int i = 0; i < sides; i++) set_groups(e, &e->items[i][f], order[i], f);
+	}
+	data += (uintptr_t) data & 1;
+
+	for (int f = 0; f <= max_file; f++) {
+		for (int i = 0; i < sides; i++) data = set_sizes(&e->items[i][f], data);
+	}
+	if (e->dtz) data = set_dtz_map(e, data, max_file);
+	for (int f = 0; f <= max_file; f++) {
+		for (int i = 0; i < sides; i++) {
+			e->items[i][f].sparse_index = data;
+			data += 6 * e->items[i][f].sparse_index_size;
+		}
+	}
+	for (int f = 0; f <= max_file; f++) {
+		for (int i = 0; i < sides; i++) {
+			e->items[i][f].block_length = data;
+			data += 2 * e->items[i][f].block_length_size;
+		}
+	}
+	for (int f = 0; f <= max_file; f++) {
+		for (int i = 0; i < sides; i++) {
+			data = (const uint8_t *) (((uintptr_t) data + 0x3F) & ~(uintptr_t) 0x3F); // 64-byte aligned
+			e->items[i][f].data = data;
+			data += e->items[i][f].num_blocks * e->items[i][f].block_size;
+			if (e->items[i][f].num_blocks > 0 && data > end) return false; // truncated
+		}
+	}
+	return true;
+}
+
+static void free_table(tb_table *e) {
+	for (int i = 0; i < 2; i++) {
+		for (int f = 0; f < 4; f++) {
+			free(e->items[i][f].base64);
+			free(e->items[i][f].symlen);
+		}
+	}
+	if (e->base != NULL) munmap(e->base, e->mapping);
+	free(e);
+}
+
+// Map and set up a table on first use; safe to call from several threads
+static bool table_ready(tb_table *e) {
+	if (__atomic_load_n(&e->ready, __ATOMIC_ACQUIRE)) return e->base != NULL;
+	pthread_mutex_lock(&tb_mutex);
+	if (!e->ready) {
+		const uint8_t *data = map_table_file(e);
+		if (data != NULL && !setup_table(e, data)) {
+			stdout_fprintf(logstr, "info string corrupt tablebase file %s%s\n", e->name, e->dtz ? ".rtbz" : ".rtbw");
+			munmap(e->base, e->mapping);
+			e->base = NULL;
+		}
+		__atomic_store_n(&e->ready, true, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&tb_mutex);
+	return e->base != NULL;
+}
+
+/*
+ * Decoding
+ */
+
+// The value at position idx of a subtable
+static int decompress_pairs(pairs_data *d, uint64_t idx) {
+	if (d->flags & FLAG_SINGLE_VALUE) return d->min_sym_len;
+
+	// Sparse index entry k points at the block holding value k * span + span / 2; walk from
+	// there to the block holding idx
+	uint32_t k = (uint32_t) (idx / d->span);
+	uint32_t block = read_le32(d->sparse_index + 6 * k);
+	int offset = read_le16(d->sparse_index + 6 * k + 4);
+	offset += (int) (idx % d->span) - (int) (d->span / 2);
+	while (offset < 0) offset += read_le16(d->block_length + 2 * --block) + 1;
+	while (offset > read_le16(d->block_length + 2 * block)) offset -= read_le16(d->block_length + 2 * block++) + 1;
+
+	// Decode symbols from the start of the block until one covers the offset
+	const uint8_t *ptr = d->data + (uint64_t) block * d->block_size;
+	uint64_t buf64 = read_be64(ptr);
+	ptr += 8;
+	int buf64_size = 64;
+	int sym;
+	while (true) {
+		int len = 0; // less min_sym_len
+		while (buf64 < d->base64[len]) len++;
+		sym = (int) ((buf64 - d->base64[len]) >> (64 - len - d->min_sym_len));
+		sym = (uint16_t) (sym + read_le16(d->lowest_sym + 2 * len));
+		if (offset < d->symlen[sym] + 1) break;
+		offset -= d->symlen[sym] + 1;
+		len += d->min_sym_len;
+		buf64 <<= len;
+		buf64_size -= len;
+		if (buf64_size <= 32) { // refill
+			buf64_size += 32;
+			buf64 |= (uint64_t) read_be32(ptr) << (64 - buf64_size);
+			ptr += 4;
+		}
+	}
+
+	// Expand the symbol down to the single value at the offset
+	while (d->symlen[sym] != 0) {
+		int left = sym_left(d, sym);
+		if (offset < d->symlen[left] + 1) sym = left;
+		else {
+			offset -= d->symlen[left] + 1;
+			sym = sym_right(d, sym);
+		}
+	}
+	return sym_left(d, sym);
+}
+
+static int map_dtz_score(tb_table *e, int file, int value, int wdl) {
+	static const int wdl_map[5] = {1, 3, 0, 2, 0}; // map_idx slot by wdl + 2
+	pairs_data *d = subtable(e, 0, file);
+	if (d->flags & FLAG_MAPPED) {
+		int idx = d->map_idx[wdl_map[wdl + 2]] + value;
+		value = (d->flags & FLAG_WIDE) ? read_le16(e->map + 2 * idx) : e->map[idx];
+	}
+	// Convert moves to plies where the table stores moves
+	if ((wdl == TB_WIN && !(d->flags & FLAG_WIN_PLIES)) || (wdl == TB_LOSS && !(d->flags & FLAG_LOSS_PLIES))
+		|| wdl == TB_CURSED_WIN || wdl == TB_BLESSED_LOSS) value *= 2;
+	return value + 1;
+}
+
+static inline int tb_piece_code(piece p) {
+	return piece_index(p) % 6 + 1 + (p.white ? 0 : 8);
+}
+
+static inline int piece_count(board *b) {
+	int count = 0;
+	for (int i = 0; i < 12; i++) count += b->piece_counts[i];
+	return count;
+}
+
+static void sort_squares(int *squares, int count, const int *order_by) {
+	for (int i = 1; i < count; i++) {
+		int sq = squares[i], j = i - 1;
+		int key = order_by ? order_by[sq] : sq;
+		for (; j >= 0 && (order_by ? order_by[squares[j]] : squares[j]) > key; j--) squares[j + 1] = squares[j];
+		squares[j + 1] = sq;
+	}
+}
+
+// Encode the position as an index into the table, and decode the value stored there. Tables
+// hold positions with the first side in their name as white; others are flipped to match.
+static int probe_table_entry(board *b, tb_table *e, int wdl, probe_state *result) {
+	int squares[TB_MAX_PIECES], pieces[TB_MAX_PIECES];
+	int size = 0, lead_count = 0, file = 0;
+	uint64_t idx;
+
+	// Symmetric tables only hold white to move
+	bool flip = (e->key == e->key2 && b->black_to_move) || material_key(b->piece_counts) != e->key;
+	int flip_color = flip ? 8 : 0, flip_squares = flip ? 56 : 0;
+	int stm = flip ^ b->black_to_move;
+
+	// Tables with pawns are split by the file of the leading pawn, which comes first
+	bool lead_white = false;
+	if (e->has_pawns) {
+		lead_white = !((e->items[0][0].pieces[0] ^ flip_color) & 8);
+		for (int sq = 0; sq < 64; sq++) {
+			piece p = b->b[sq & 7][sq >> 3];
+			if (p.type == 'P' && p.white == lead_white) squares[size++] = sq ^ flip_squares;
+		}
+		lead_count = size;
+		int lead = 0;
+		for (int i = 1; i < lead_count; i++) {
+			if (map_pawns[squares[i]] > map_pawns[squares[lead]]) lead = i;
+		}
+		int temp = squares[0];
+		squares[0] = squares[lead];
+		squares[lead] = temp;
+		file = min(squares[0] & 7, 7 - (squares[0] & 7));
+	}
+
+	// DTZ tables hold one side to move
+	if (e->dtz) {
+		int flags = subtable(e, stm, file)->flags;
+		if ((flags & FLAG_STM) != stm && !(e->key == e->key2 && !e->has_pawns)) {
+			*result = PROBE_CHANGE_STM;
+			return 0;
+		}
+	}
+
+	for (int sq = 0; sq < 64; sq++) {
+		piece p = b->b[sq & 7][sq >> 3];
+		if (p_eq(p, no_piece) || (e->has_pawns && p.type == 'P' && p.white == lead_white)) continue;
+		squares[size] = sq ^ flip_squares;
+		pieces[size++] = tb_piece_code(p) ^ flip_color;
+	}
+
+	// Order the pieces as the table does
+	pairs_data *d = subtable(e, stm, file);
+	for (int i = lead_count; i < size - 1; i++) {
+		for (int j = i + 1; j < size; j++) {
+			if (d->pieces[i] == pieces[j]) {
+				int temp = pieces[i];
+				pieces[i] = pieces[j];
+				pieces[j] = temp;
+				temp = squares[i];
+				squares[i] = squares[j];
+				squares[j] = temp;
+				break;
+			}
+		}
+	}
+
+	// Mirror the leading piece onto files a-d
+	if ((squares[0] & 7) > 3) {
+		for (int i = 0; i < size; i++) squares[i] ^= 7;
+	}
+
+	if (e->has_pawns) {
+		idx = lead_pawn_idx[lead_count][squares[0]];
+		sort_squares(squares + 1, lead_count - 1, map_pawns);
+		for (int i = 1; i < lead_count; i++) idx += binomial[i][map_pawns[squares[i]]];
+	} else {
+		// Without pawns, also mirror onto ranks 1-4 and below the a1-h8 diagonal
+		if ((squares[0] >> 3) > 3) {
+			for (int i = 0; i < size; i++) squares[i] ^= 56;
+		}
+		for (int i = 0; i < d->group_len[0]; i++) {
+			if (off_a1h8(squares[i]) == 0) continue;
+			if (off_a1h8(squares[i]) > 0) {
+				for (int j = i; j < size; j++) squares[j] = ((squares[j] >> 3) | (squares[j] << 3)) & 63;
+			}
+			break;
+		}
+
+		if (e->has_unique_pieces) { // the first three pieces are encoded together
+			int adjust1 = squares[1] > squares[0];
+			int adjust2 = (squares[2] > squares[0]) + (squares[2] > squares[1]);
+			if (off_a1h8(squares[0])) {
+				idx = ((uint64_t) map_a1d1d4[squares[0]] * 63 + (squares[1] - adjust1)) * 62 + squares[2] - adjust2;
+			} else if (off_a1h8(squares[1])) {
+				idx = (6 * 63 + (squares[0] >> 3) * 28 + map_b1h1h7[squares[1]]) * 62 + squares[2] - adjust2;
+			} else if (off_a1h8(squares[2])) {
+				idx = 6 * 63 * 62 + 4 * 28 * 62 + (squares[0] >> 3) * 7 * 28
+					+ ((squares[1] >> 3) - adjust1) * 28 + map_b1h1h7[squares[2]];
+			} else {
+				idx = 6 * 63 * 62 + 4 * 28 * 62 + 4 * 7 * 28 + (squares[0] >> 3) * 7 * 6
+					+ ((squares[1] >> 3) - adjust1) * 6 + ((squares[2] >> 3) - adjust2);
+			}
+		} else { // just the kings
+			idx = map_kk[map_a1d1d4[squares[0]]][squares[1]];
+		}
+	}
+
+	// Each remaining group is a combination of the squares the groups before it left free
+	idx *= d->group_idx[0];
+	int *group_sq = squares + d->group_len[0];
+	bool remaining_pawns = e->has_pawns && e->pawn_count[1];
+	for (int next = 1; d->group_len[next] != 0; next++) {
+		sort_squares(group_sq, d->group_len[next], NULL);
+		uint64_t n = 0;
+		for (int i = 0; i < d->group_len[next]; i++) {
+			int adjust = 0;
+			for (int *s = squares; s < group_sq; s++) adjust += group_sq[i] > *s;
+			n += binomial[i + 1][group_sq[i] - adjust - (remaining_pawns ? 8 : 0)];
+		}
+		remaining_pawns = false;
+		idx += n * d->group_idx[next];
+		group_sq += d->group_len[next];
+	}
+
+	int value = decompress_pairs(d, idx);
+	return e->dtz ? map_dtz_score(e, file, value, wdl) : value - 2;
+}
+
+static tb_entry *tb_lookup(uint64_t key) {
+	uint64_t slot = (key * 0x9E3779B97F4A7C15ULL) >> (64 - TB_HASH_BITS);
+	while (tb_hash[slot].key != 0) {
+		if (tb_hash[slot].key == key) return &tb_hash[slot];
+		slot = (slot + 1) & ((1 << TB_HASH_BITS) - 1);
+	}
+	return NULL;
+}
+
+static int probe_table(board *b, bool dtz, int wdl, probe_state *result) {
+	if (piece_count(b) == 2) return TB_DRAW; // bare kings
+	tb_entry *entry = tb_lookup(material_key(b->piece_counts));
+	tb_table *e = entry == NULL ? NULL : dtz ? entry->dtz : entry->wdl;
+	if (e == NULL || !table_ready(e)) {
+		*result = PROBE_FAIL;
+		return 0;
+	}
+	return probe_table_entry(b, e, wdl, result);
+}
+
+/*
+ * Probing
+ */
+
+static inline bool moved_into_check(board *b) {
+	coord king_loc = b->black_to_move ? b->white_king : b->black_king; // for side that just moved
+	return in_check(b, king_loc.col, king_loc.row, !b->black_to_move);
+}
+
+static inline bool is_zeroing(board *b, move m) {
+	return !p_eq(m.captured, no_piece) || m.en_passant_capture || at(b, m.from).type == 'P';
+}
+
+static inline int sign_of(int x) {
+	return (x > 0) - (x < 0);
+}
+
+// DTZ tables do not store a position whose best move zeroes the 50-move counter; its DTZ is
+// one more ply than the position after the move
+static int dtz_before_zeroing(int wdl) {
+	return wdl == TB_WIN ? 1 : wdl == TB_CURSED_WIN ? 101 : wdl == TB_BLESSED_LOSS ? -101 : wdl == TB_LOSS ? -1 : 0;
+}
+
+// The generator stores whatever compresses best for positions where a capture (or for DTZ, a
+// pawn move) is at least as good as the stored value, so those moves must be tried as well.
+static int probe_wdl_search(board *b, bool check_pawn_moves, probe_state *result) {
+	int value, best_value = TB_LOSS;
+	move moves[MAX_MOVES];
+	int count = 0, legal_count = 0, zeroing_count = 0;
+	board_moves_into(b, moves, &count, false);
+	for (int i = 0; i < count; i++) {
+		bool capture = !p_eq(moves[i].captured, no_piece) || moves[i].en_passant_capture;
+		bool pawn_move = at(b, moves[i].from).type == 'P';
+		apply(b, moves[i]);
+		if (moved_into_check(b)) {
+			unapply(b, moves[i]);
+			continue;
+		}
+		legal_count++;
+		if (!capture && (!check_pawn_moves || !pawn_move)) {
+			unapply(b, moves[i]);
+			continue;
+		}
+		zeroing_count++;
+		value = -probe_wdl_search(b, false, result);
+		unapply(b, moves[i]);
+		if (*result == PROBE_FAIL) return TB_DRAW;
+		if (value > best_value) {
+			best_value = value;
+			if (value >= TB_WIN) {
+				*result = PROBE_ZEROING_BEST_MOVE;
+				return value;
+			}
+		}
+	}
+
+	// If every legal move was tried, the table is not needed (and might be wrong, as it
+	// ignores en passant)
+	bool no_more_moves = (zeroing_count > 0 && zeroing_count == legal_count);
+	if (no_more_moves) value = best_value;
+	else {
+		value = probe_table(b, false, TB_DRAW, result);
+		if (*result == PROBE_FAIL) return TB_DRAW;
+	}
+	if (best_value >= value) {
+		*result = (best_value > TB_DRAW || no_more_moves) ? PROBE_ZEROING_BEST_MOVE : PROBE_OK;
+		return best_value;
+	}
+	*result = PROBE_OK;
+	return value;
+}
+
+static int probe_dtz(board *b, probe_state *result) {
+	*result = PROBE_OK;
+	int wdl = probe_wdl_search(b, true, result);
+	if (*result == PROBE_FAIL || wdl == TB_DRAW) return 0; // draws are not stored
+	if (*result == PROBE_ZEROING_BEST_MOVE) return dtz_before_zeroing(wdl);
+
+	int dtz = probe_table(b, true, wdl, result);
+	if (*result == PROBE_FAIL) return 0;
+	if (*result != PROBE_CHANGE_STM) {
+		return (dtz + 100 * (wdl == TB_BLESSED_LOSS || wdl == TB_CURSED_WIN)) * sign_of(wdl);
+	}
+
+	// The table holds the other side to move: take the best DTZ over the replies
+	int min_dtz = 0xFFFF;
+	move moves[MAX_MOVES];
+	int count = 0;
+	board_moves_into(b, moves, &count, false);
+	for (int i = 0; i < count; i++) {
+		bool zeroing = is_zeroing(b, moves[i]);
+		apply(b, moves[i]);
+		if (moved_into_check(b)) {
+			unapply(b, moves[i]);
+			continue;
+		}
+		// After a zeroing move only the result matters; the count restarts
+		dtz = zeroing ? -dtz_before_zeroing(probe_wdl_search(b, false, result)) : -probe_dtz(b, result);
+		coord king_loc = b->black_to_move ? b->black_king : b->white_king;
+		if (dtz == 1 && in_check(b, king_loc.col, king_loc.row, b->black_to_move) && count_legal_moves(b) == 0) {
+			min_dtz = 1; // mate
+		}
+		if (!zeroing) dtz += sign_of(dtz);
+		if (dtz < min_dtz && sign_of(dtz) == sign_of(wdl)) min_dtz = dtz;
+		unapply(b, moves[i]);
+		if (*result == PROBE_FAIL) return 0;
+	}
+	return min_dtz == 0xFFFF ? -1 : min_dtz; // no legal moves: mated
+}
+
+static bool probeable(board *b) {
+	return tb_cardinality() > 0 && piece_count(b) <= tb_cardinality() && !b->castle_rights_wq
+		&& !b->castle_rights_wk && !b->castle_rights_bq && !b->castle_rights_bk;
+}
+
+bool tb_probe_wdl(board *b, int *wdl) {
+	if (!probeable(b)) return false;
+	probe_state result = PROBE_OK;
+	*wdl = probe_wdl_search(b, false, &result);
+	return result != PROBE_FAIL;
+}
+
+bool tb_probe_dtz(board *b, int *dtz) {
+	if (!probeable(b)) return false;
+	probe_state result;
+	*dtz = probe_dtz(b, &result);
+	return result != PROBE_FAIL;
+}
+
+bool tb_probe_root(board *b, move *best, int *score) {
+	if (!probeable(b)) return false;
+	move moves[MAX_MOVES];
+	int count = 0, best_rank = INT_MIN, best_dtz = 0;
+	board_moves_into(b, moves, &count, false);
+	for (int i = 0; i < count; i++) {
+		bool zeroing = is_zeroing(b, moves[i]);
+		apply(b, moves[i]);
+		if (moved_into_check(b)) {
+			unapply(b, moves[i]);
+			continue;
+		}
+		// DTZ of the move, counted from the root
+		probe_state result = PROBE_OK;
+		int dtz;
+		if (zeroing) dtz = dtz_before_zeroing(-probe_wdl_search(b, false, &result));
+		else {
+			dtz = -probe_dtz(b, &result);
+			dtz += sign_of(dtz);
+		}
+		coord king_loc = b->black_to_move ? b->black_king : b->white_king;
+		if (dtz == 2 && in_check(b, king_loc.col, king_loc.row, b->black_to_move) && count_legal_moves(b) == 0) {
+			dtz = 1; // mate
+		}
+		unapply(b, moves[i]);
+		if (result == PROBE_FAIL) return false;
+		// Quickest wins first, then draws, then the slowest losses
+		int rank = dtz > 0 ? MAX_DTZ - dtz : dtz < 0 ? -MAX_DTZ - dtz : 0;
+		if (rank > best_rank) {
+			best_rank = rank;
+			best_dtz = dtz;
+			*best = moves[i];
+		}
+	}
+	if (best_rank == INT_MIN) return false; // mate or stalemate
+	int wdl = best_dtz > 100 ? TB_CURSED_WIN : best_dtz > 0 ? TB_WIN
+		: best_dtz < -100 ? TB_BLESSED_LOSS : best_dtz < 0 ? TB_LOSS : TB_DRAW;
+	*score = tb_wdl_score(wdl, 0);
+	return true;
+}
+
+/*
+ * Initialization
+ */
+
+static tb_table *new_table(const char *name, bool dtz) {
+	tb_table *e = calloc(1, sizeof(tb_table));
+	strcpy(e->name, name);
+	e->dtz = dtz;
+	uint8_t counts[12] = {0};
+	int side = 0;
+	e->piece_count = 0;
+	for (const char *c = name; *c; c++) {
+		if (*c == 'v') {
+			side = 6;
+			continue;
+		}
+		counts[side + (int) (strchr("PNBRQK", *c) - "PNBRQK")]++;
+		e->piece_count++;
+	}
+	e->key = material_key(counts);
+	uint8_t swapped[12];
+	for (int i = 0; i < 12; i++) swapped[i] = counts[(i + 6) % 12];
+	e->key2 = material_key(swapped);
+
+	e->has_pawns = counts[0] + counts[6] > 0;
+	for (int i = 0; i < 12; i++) {
+		if (i % 6 != 5 && counts[i] == 1) e->has_unique_pieces = true;
+	}
+	// The side with fewer pawns leads, as that compresses better
+	bool white_leads = counts[6] == 0 || (counts[0] > 0 && counts[6] >= counts[0]);
+	e->pawn_count[0] = white_leads ? counts[0] : counts[6];
+	e->pawn_count[1] = white_leads ? counts[6] : counts[0];
+	tb_tables[tb_table_count++] = e;
+	return e;
+}
+
+static void tb_insert(uint64_t key, tb_table *wdl, tb_table *dtz) {
+	uint64_t slot = (key * 0x9E3779B97F4A7C15ULL) >> (64 - TB_HASH_BITS);
+	while (tb_hash[slot].key != 0) {
+		if (tb_hash[slot].key == key) return; // symmetric tables have one key
+		slot = (slot + 1) & ((1 << TB_HASH_BITS) - 1);
+	}
+	tb_hash[slot] = (tb_entry) {key, wdl, dtz};
+}
+
+// Register a table if its WDL file exists; types are indices into "PNBRQK"
+static void add_table(const int *types, int count) {
+	char name[TB_MAX_PIECES + 2];
+	int length = 0;
+	for (int i = 0; i < count; i++) {
+		if (i > 0 && types[i] == 5) name[length++] = 'v'; // the second king starts the other side
+		name[length++] = "PNBRQK"[types[i]];
+	}
+	name[length] = '\0';
+	int fd = open_table_file(name, ".rtbw");
+	if (fd < 0) return;
+	close(fd);
+	tb_largest = max(tb_largest, count);
+	tb_table *wdl = new_table(name, false);
+	tb_table *dtz = new_table(name, true);
+	tb_insert(wdl->key, wdl, dtz);
+	tb_insert(wdl->key2, wdl, dtz);
+}
+
+int tb_init(const char *paths) {
+	for (int i = 0; i < tb_table_count; i++) free_table(tb_tables[i]);
+	free(tb_tables);
+	tb_tables = NULL;
+	tb_table_count = 0;
+	tb_largest = 0;
+	memset(tb_hash, 0, sizeof(tb_hash));
+	tb_paths[0] = '\0';
+	if (paths == NULL || paths[0] == '\0' || strcmp(paths, "<empty>") == 0) return 0;
+	strncpy(tb_paths, paths, sizeof(tb_paths) - 1);
+	init_indices();
+
+	// Every table of up to TB_MAX_PIECES, stronger side first
+	const int king_index = 5;
+	tb_tables = malloc(sizeof(tb_table *) * (1 << TB_HASH_BITS));
+	for (int p1 = 0; p1 < king_index; p1++) {
+		add_table((int[]) {king_index, p1, king_index}, 3);
+		for (int p2 = 0; p2 <= p1; p2++) {
+			add_table((int[]) {king_index, p1, p2, king_index}, 4);
+			add_table((int[]) {king_index, p1, king_index, p2}, 4);
+			for (int p3 = 0; p3 < king_index; p3++) add_table((int[]) {king_index, p1, p2, king_index, p3}, 5);
+			for (int p3 = 0; p3 <= p2; p3++) {
+				add_table((int[]) {king_index, p1, p2, p3, king_index}, 5);
+				for (int p4 = 0; p4 <= p3; p4++) {
+					add_table((int[]) {king_index, p1, p2, p3, p4, king_index}, 6);
+					for (int p5 = 0; p5 <= p4; p5++) add_table((int[]) {king_index, p1, p2, p3, p4, p5, king_index}, 7);
+					for (int p5 = 0; p5 < king_index; p5++) add_table((int[]) {king_index, p1, p2, p3, p4, king_index, p5}, 7);
+				}
+				for (int p4 = 0; p4 < king_index; p4++) {
+					add_table((int[]) {king_index, p1, p2, p3, king_index, p4}, 6);
+					for (int p5 = 0; p5 <= p4; p5++) add_table((int[]) {king_index, p1, p2, p3, king_index, p4, p5}, 7);
+				}
+			}
+			for (int p3 = 0; p3 <= p1; p3++) {
+				for (int p4 = 0; p4 <= (p1 == p3 ? p2 : p3); p4++) add_table((int[]) {king_index, p1, p2, king_index, p3, p4}, 6);
+			}
+		}
+	}
+	stdout_fprintf(logstr, "info string found %d tablebases of up to %d pieces\n", tb_table_count / 2, tb_largest);
+	return tb_table_count / 2;
+}
+
+void tb_set_probe_limit(int pieces) {
+	tb_limit = max(0, min(TB_MAX_PIECES, pieces));
+}
+
+int tb_cardinality(void) {
+	return min(tb_limit, tb_largest);
+}
@@ -0,0 +1,61 @@
+#ifndef TBPROBE_H
+#define TBPROBE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "settings.h"
+#include "types.h"
+#include "util.h"
+
+/**
+ * Syzygy Tablebase Public API
+ *
+ * Probes Syzygy WDL (.rtbw) and DTZ (.rtbz) files of up to TB_MAX_PIECES pieces. Only the
+ * presence of each WDL file is checked when the tables are scanned; a file is memory mapped on
+ * the first probe that needs it, and its pages are read in by the OS as probes touch them.
+ *
+ * The WDL tables are probed inside the search and the DTZ tables choose the move at the root.
+ * Neither is probed while either side may still castle. The decoder follows the reference
+ * probing code by Ronald de Man.
+ */
+
+#define TB_MAX_PIECES 7
+
+// Results of a WDL probe, for the side to move. Cursed wins and blessed losses would be wins
+// and losses but for the 50-move rule.
+#define TB_LOSS -2
+#define TB_BLESSED_LOSS -1
+#define TB_DRAW 0
+#define TB_CURSED_WIN 1
+#define TB_WIN 2
+
+// Scan the directories in paths, separated by ':', for tables, replacing any found before.
+// "<empty>" or an empty string disables probing. Returns the number of tables found.
+int tb_init(const char *paths);
+
+// Limit probes to positions with at most this many pieces, kings included.
+void tb_set_probe_limit(int pieces);
+
+// The most pieces a probe can succeed with, or 0 if no tables are loaded.
+int tb_cardinality(void);
+
+// Probe the WDL tables; returns false if the position is not covered.
+bool tb_probe_wdl(board *b, int *wdl);
+
+// Probe the DTZ tables; returns false if the position is not covered. The result is the plies
+// to the next capture or pawn move for the side to move, positive when winning and negative
+// when losing (see the reference code for the details), or 0 for a draw.
+bool tb_probe_dtz(board *b, int *dtz);
+
+// Choose the move that keeps the best result in the fewest plies to a zeroing move (or
+// resists a loss the longest). Returns false if the position is not covered.
+bool tb_probe_root(board *b, move *best, int *score);
+
+// The search score of a WDL result, height plies from the root; nearer wins score higher
+static inline int tb_wdl_score(int wdl, int height) {
+	if (wdl == TB_WIN) return tb_win_score - height;
+	if (wdl == TB_LOSS) return -tb_win_score + height;
+	return wdl; // draws, including those forced by the 50-move rule
+}
+
+#endif
@@ -1,7 +1,5 @@
 #include "ttable.h"
-
-void tt_auto_cleanup(void);
-bool tt_expand(void);
+#include "movegen.h"
 
 // Zobrist table data for hashing board positions
 uint64_t zobrist[64][12]; // zobrist table for pieces
@@ -12,103 +10,432 @@ uint64_t zobrist_castle_bk;
 uint64_t zobrist_black_to_move;
 uint64_t zobrist_en_passant_files[8];
 
-// How large should the table be?
+// How large should new tables be?
 int tt_megabytes = TT_MEGABYTES_DEFAULT;
 
-// Table data
-static uint64_t *tt_keys = NULL;
-static evaluation *tt_values = NULL;
-//static pthread_mutex_t *tt_locks = NULL;
-static uint8_t *tt_node_thread_counts = NULL;
-static uint64_t tt_size;
-static uint64_t tt_count = 0;
-static uint64_t tt_rehash_count; // When to perform a rehash; computed based on max_load
-static bool is_initialized = false;
-
-// To prevent the search worker from being killed while writing to the table
-bool search_terminate_requested = false;
+static bool zobrist_initialized = false;
 
 // The index of a given board coordinate in the Zobrist table
 static inline int square_code(coord c) {
 	return (c.col)*8+c.row;
 }
 
-// The percentage load on the table
-double tt_load() {
-	assert(is_initialized);
-	return 100 * ((double) tt_count) / tt_size;
+// The part of a hash stored in an entry; the bucket index supplies more. Never zero, which
+// marks an empty entry.
+static inline uint16_t tt_key(uint64_t hash) {
+	uint16_t key = (uint16_t) (hash >> 48);
+	return key != 0 ? key : 1;
 }
 
-uint64_t get_tt_count() {
-	return tt_count;
+_Static_assert(sizeof(tt_bucket) == 64, "a bucket must fill one cache line");
+
+/*
+ * An entry's data word packs an evaluation: the move in bits 0-15 (see tt_pack_move), the
+ * score in 16-31, the depth in 32-39, the generation in 40-47 and the type in 48-55. The rest of
+ * the move is recovered from the board when the entry is found.
+ *
+ * Entries are shared by every thread searching the table, with no locks. Each word is read and
+ * written atomically, but a reader can still see a check and a data word from two different
+ * writes; since the check holds the key XOR the data, such a torn entry almost always fails to
+ * match its key and reads as a miss. An entry left torn by two racing writers is likewise never
+ * found, and is replaced in time.
+ */
+
+static inline uint16_t tt_fold(uint64_t data) {
+	return (uint16_t) (data ^ (data >> 16) ^ (data >> 32) ^ (data >> 48));
 }
 
-uint64_t get_tt_size() {
-	return tt_size;
+// Read an entry; returns the key it was stored under, which is garbage if the entry is torn
+static inline uint16_t tt_entry_load(const tt_bucket *bucket, int i, uint64_t *data) {
+	uint16_t check = __atomic_load_n(&bucket->checks[i], __ATOMIC_RELAXED);
+	*data = __atomic_load_n(&bucket->data[i], __ATOMIC_RELAXED);
+	return check ^ tt_fold(*data);
 }
 
-// Invoke to prepare transposition table
-void tt_init(void) {
-	// First, compute size from memory use
-	const uint64_t bytes_in_mb = 1000000;
-	tt_size = (uint64_t) (ceil(((double) (tt_megabytes * bytes_in_mb)) / 
-		(sizeof(evaluation) + sizeof(uint64_t))));
-	uint64_t check_mb_size = (uint64_t) ((double) tt_size * (sizeof(evaluation) + sizeof(uint64_t))) / bytes_in_mb;
-	printf("info string initializing ttable with %llu slots for total size %llumb\n", tt_size, check_mb_size);
-
-	if (tt_keys != NULL) free(tt_keys);
-	if (tt_values != NULL) free(tt_values);
-	//if (tt_locks != NULL) free(tt_locks);
-	if (tt_node_thread_counts != NULL) free(tt_node_thread_counts);
-	tt_keys = malloc(sizeof(uint64_t) * tt_size);
-	assert(tt_keys != NULL);
-	memset(tt_keys, 0, tt_size * sizeof(uint64_t));
-	tt_values = malloc(sizeof(evaluation) * tt_size);
-	assert(tt_values != NULL);
-	//tt_locks = malloc(sizeof(pthread_mutex_t) * tt_size);
-	//assert(tt_locks != NULL);
-	//tt_node_thread_counts = malloc(sizeof(uint8_t) * tt_size);
-	//memset(tt_node_thread_counts, 0, tt_size * sizeof(uint8_t));
-	//assert(tt_node_thread_counts != NULL);
-	tt_count = 0;
-	tt_rehash_count = (uint64_t) (ceil(tt_max_load * tt_size));
-
-	/*for (int i = 0; i < tt_size; i++) {
-		pthread_mutex_init(tt_locks + i, NULL);
-	}*/
-
-	// Populate Zobrist data
-	srand((unsigned int) time(NULL));
+static inline void tt_entry_store(tt_bucket *bucket, int i, uint16_t key, uint64_t data) {
+	__atomic_store_n(&bucket->data[i], data, __ATOMIC_RELAXED);
+	__atomic_store_n(&bucket->checks[i], key ^ tt_fold(data), __ATOMIC_RELAXED);
+}
+
+// From and to squares (row * 8 + col) in six bits each, then the promotion (none, NBRQ) in three
+static inline uint16_t tt_pack_move(move m) {
+	if (!in_bounds(m.from)) return 0; // no_move
+	int promotion = p_eq(m.promote_to, no_piece) ? 0 : (int) (strchr("NBRQ", m.promote_to.type) - "NBRQ") + 1;
+	return (m.from.row * 8 + m.from.col) | (m.to.row * 8 + m.to.col) << 6 | promotion << 12;
+}
+
+static inline uint64_t tt_pack(evaluation e) {
+	return tt_pack_move(e.best) | (uint64_t) (uint16_t) e.score << 16 | (uint64_t) (uint8_t) e.depth << 32
+		| (uint64_t) e.generation << 40 | (uint64_t) (uint8_t) e.type << 48;
+}
+
+// The evaluation in a data word, but for the move, which needs the board (see tt_unpack_move)
+static inline evaluation tt_unpack(uint64_t data) {
+	evaluation e = no_eval;
+	e.score = (int16_t) (data >> 16);
+	e.depth = (int8_t) (data >> 32);
+	e.generation = (uint8_t) (data >> 40);
+	e.type = (int8_t) (data >> 48);
+	return e;
+}
+
+// Complete a packed move from the board. Returns false if it is not a move on this board, as
+// when another position shares the entry's key.
+static bool tt_unpack_move(board *b, uint16_t packed, move *m) {
+	if (packed == 0) {
+		*m = no_move;
+		return true;
+	}
+	coord from = {packed & 7, (packed >> 3) & 7}, to = {(packed >> 6) & 7, (packed >> 9) & 7};
+	piece mover = at(b, from);
+	int promotion = (packed >> 12) & 7;
+	if (promotion > 4) return false;
+	m->from = from;
+	m->to = to;
+	m->captured = at(b, to);
+	m->promote_to = promotion ? (piece) {"NBRQ"[promotion - 1], mover.white} : no_piece;
+	m->c = N;
+	if (mover.type == 'K' && to.col == from.col + 2) m->c = K;
+	else if (mover.type == 'K' && to.col + 2 == from.col) m->c = Q;
+	m->en_passant_capture = mover.type == 'P' && from.col != to.col && p_eq(m->captured, no_piece);
+	return is_pseudo_legal(b, *m);
+}
+
+#define TT_LOAD_SAMPLE_BUCKETS 167 // about 1000 entries, like the UCI hashfull permill
+
+// The percentage of sampled entries stored or found in this generation. tt->count cannot tell,
+// since tt_clear only ages entries.
+double tt_load(ttable *tt) {
+	assert(tt->buckets != NULL);
+	uint64_t sampled = tt->bucket_count < TT_LOAD_SAMPLE_BUCKETS ? tt->bucket_count : TT_LOAD_SAMPLE_BUCKETS;
+	uint64_t used = 0;
+	for (uint64_t n = 0; n < sampled; n++) {
+		for (int i = 0; i < TT_BUCKET_ENTRIES; i++) {
+			uint64_t data;
+			if (tt_entry_load(tt->buckets + n, i, &data) != 0 && tt_unpack(data).generation == tt->generation) used++;
+		}
+	}
+	return 100 * ((double) used) / (sampled * TT_BUCKET_ENTRIES);
+}
+
+uint64_t get_tt_count(ttable *tt) {
+	return tt->count;
+}
+
+uint64_t get_tt_size(ttable *tt) {
+	return tt->size;
+}
+
+// SplitMix64, a small generator whose output depends only on the seed
+static uint64_t zobrist_next(uint64_t *state) {
+	uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+// Populate the Zobrist keys once; every table and board shares them
+void zobrist_init(void) {
+	if (zobrist_initialized) return;
+	uint64_t state = zobrist_seed;
 	for (int i = 0; i < 64; i++) {
 		for (int j = 0; j < 12; j++) {
-			zobrist[i][j] = rand64();
+			zobrist[i][j] = zobrist_next(&state);
+		}
+	}
+	zobrist_castle_wq = zobrist_next(&state);
+	zobrist_castle_wk = zobrist_next(&state);
+	zobrist_castle_bq = zobrist_next(&state);
+	zobrist_castle_bk = zobrist_next(&state);
+	for (int i = 0; i < 8; i++) zobrist_en_passant_files[i] = zobrist_next(&state);
+	zobrist_black_to_move = zobrist_next(&state);
+	zobrist_initialized = true;
+}
+
+#define TT_HUGE_PAGE_BYTES (2 * 1024 * 1024)
+
+// Map zeroed memory for a table, aligned to a huge page; returns NULL on failure
+static tt_bucket *tt_map(size_t bytes) {
+	size_t padded = bytes + TT_HUGE_PAGE_BYTES;
+	uint8_t *base = mmap(NULL, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) return NULL;
+	uint8_t *aligned = (uint8_t *) (((uintptr_t) base + TT_HUGE_PAGE_BYTES - 1) & ~(uintptr_t) (TT_HUGE_PAGE_BYTES - 1));
+	if (aligned > base) munmap(base, aligned - base); // Trim the padding on either side
+	if (base + padded > aligned + bytes) munmap(aligned + bytes, base + padded - (aligned + bytes));
+#ifdef MADV_HUGEPAGE
+	// Fewer TLB misses on probes, and fewer page faults as the table fills. Fails harmlessly
+	// (with ordinary pages) when transparent huge pages are disabled.
+	if (use_tt_huge_pages) madvise(aligned, bytes, MADV_HUGEPAGE);
+#endif
+	return (tt_bucket *) aligned;
+}
+
+// Run a job for each slice of the table's buckets, on up to one thread per core
+static void tt_run_jobs(ttable *from, ttable *to, void *(*entrypoint)(void *)) {
+	size_t bytes = to->bucket_count * sizeof(tt_bucket);
+	int threads = (int) min(max((int) sysconf(_SC_NPROCESSORS_ONLN), 1), tt_clear_threads_max);
+	if (bytes < (size_t) threads * TT_HUGE_PAGE_BYTES) threads = 1; // Not worth the threads
+	tt_job jobs[threads];
+	pthread_t workers[threads];
+	bool spawned[threads];
+	uint64_t slice = to->bucket_count / threads;
+	for (int i = 0; i < threads; i++) {
+		jobs[i] = (tt_job) {from, to, i * slice, i == threads - 1 ? to->bucket_count : (i + 1) * slice, 0};
+	}
+	for (int i = 1; i < threads; i++) {
+		spawned[i] = pthread_create(workers + i, NULL, entrypoint, jobs + i) == 0;
+		if (!spawned[i]) entrypoint(jobs + i);
+	}
+	entrypoint(jobs);
+	to->count = jobs[0].count;
+	for (int i = 1; i < threads; i++) {
+		if (spawned[i]) pthread_join(workers[i], NULL);
+		to->count += jobs[i].count;
+	}
+}
+
+static void *tt_zero_entrypoint(void *param) {
+	tt_job *job = param;
+	memset(job->to->buckets + job->first, 0, (job->last - job->first) * sizeof(tt_bucket));
+	return NULL;
+}
+
+static void tt_zero(ttable *tt) {
+	tt_run_jobs(NULL, tt, &tt_zero_entrypoint);
+}
+
+static inline int tt_entry_worth(uint16_t key, evaluation value, uint8_t generation);
+
+// Fill each bucket of the new table from the buckets of the old one whose entries may belong in
+// it: those that agree with it in the index bits both tables use. Growing copies each old bucket
+// to every bucket it may have spread to; the copies in the wrong buckets are never found and are
+// replaced in time. Shrinking merges buckets, keeping the entries most worth keeping.
+static void *tt_migrate_entrypoint(void *param) {
+	tt_job *job = param;
+	ttable *from = job->from, *to = job->to;
+	uint64_t sources = from->bucket_count > to->bucket_count ? from->bucket_count / to->bucket_count : 1;
+	for (uint64_t n = job->first; n < job->last; n++) {
+		tt_bucket *dest = to->buckets + n;
+		for (uint64_t j = 0; j < sources; j++) {
+			tt_bucket *src = from->buckets + ((n & (from->bucket_count - 1)) + j * to->bucket_count);
+			for (int i = 0; i < TT_BUCKET_ENTRIES; i++) {
+				uint64_t data;
+				uint16_t key = tt_entry_load(src, i, &data);
+				if (key == 0) continue;
+				int worth = tt_entry_worth(key, tt_unpack(data), to->generation);
+				int victim = 0, victim_worth = INT_MAX;
+				for (int k = 0; k < TT_BUCKET_ENTRIES; k++) {
+					uint64_t kept;
+					uint16_t kept_key = tt_entry_load(dest, k, &kept);
+					int kept_worth = tt_entry_worth(kept_key, tt_unpack(kept), to->generation);
+					if (kept_key == key) { // A copy left by an earlier growth; keep one
+						victim = k;
+						victim_worth = kept_worth < worth ? INT_MIN : INT_MAX;
+						break;
+					}
+					if (kept_worth < victim_worth) {
+						victim = k;
+						victim_worth = kept_worth;
+					}
+				}
+				if (worth > victim_worth) tt_entry_store(dest, victim, key, data);
+			}
+		}
+		// Growing copies each old bucket into several new ones; count each entry only once
+		if (n >= from->bucket_count) continue;
+		for (int k = 0; k < TT_BUCKET_ENTRIES; k++) {
+			uint64_t kept;
+			if (tt_entry_load(dest, k, &kept) != 0) job->count++;
 		}
 	}
-	zobrist_castle_wq = rand64();
-	zobrist_castle_wk = rand64();
-	zobrist_castle_bq = rand64();
-	zobrist_castle_bk = rand64();
-	for (int i = 0; i < 8; i++) zobrist_en_passant_files[i] = rand64();
-	zobrist_black_to_move = rand64();
-	atexit(tt_auto_cleanup);
-	is_initialized = true;
-}
-
-// Automatically called
-void tt_auto_cleanup(void) {
-	// Commented out in the interm for the sake of killing the worker thread
-	/*if (tt_keys) free(tt_keys);
-	tt_keys = NULL;
-	if (tt_values) free(tt_values);
-	tt_values = NULL;
-	if (tt_threads) free(tt_values);
-	tt_values = NULL;*/
+	return NULL;
+}
+
+#define TT_BYTES_IN_MB (1024 * 1024)
+
+// The most memory the table may use without swapping: the memory the system has available, and
+// whatever the table already holds, since it is released when the table is replaced; but no more
+// than the container's limit
+static uint64_t tt_memory_limit(const ttable *tt) {
+	uint64_t available = (uint64_t) sysconf(_SC_AVPHYS_PAGES) * (uint64_t) sysconf(_SC_PAGE_SIZE);
+	FILE *meminfo = fopen("/proc/meminfo", "r");
+	if (meminfo != NULL) { // MemAvailable also counts caches the kernel can drop
+		char line[128];
+		unsigned long long kb;
+		while (fgets(line, sizeof(line), meminfo) != NULL) {
+			if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1) available = kb * 1024;
+		}
+		fclose(meminfo);
+	}
+	uint64_t limit = available + (tt->buckets != NULL ? tt->mapped_bytes : 0);
+	const char *cgroup_limits[] = {"/sys/fs/cgroup/memory.max", "/sys/fs/cgroup/memory/memory.limit_in_bytes"};
+	for (int i = 0; i < 2; i++) {
+		FILE *f = fopen(cgroup_limits[i], "r");
+		if (f == NULL) continue;
+		unsigned long long cgroup_limit;
+		if (fscanf(f, "%llu", &cgroup_limit) == 1 && cgroup_limit < limit) limit = cgroup_limit; // "max" is no limit
+		fclose(f);
+	}
+	return limit;
+}
+
+// The most buckets that fit in the given size: a power of two, so that a hash selects its bucket
+// with a mask
+static uint64_t tt_bucket_count_for(int megabytes) {
+	uint64_t bytes = (uint64_t) max(megabytes, 1) * TT_BYTES_IN_MB;
+	uint64_t count = 1;
+	while (count * 2 * sizeof(tt_bucket) <= bytes) count *= 2;
+	return count;
+}
+
+// Map an empty table of the given size
+static void tt_allocate(ttable *tt, uint64_t bucket_count) {
+	tt->bucket_count = bucket_count;
+	tt->size = tt->bucket_count * TT_BUCKET_ENTRIES;
+	size_t bytes = tt->bucket_count * sizeof(tt_bucket);
+	printf("info string initializing ttable with %llu slots for total size %llumb\n", tt->size, bytes / TT_BYTES_IN_MB);
+	// Round up to whole huge pages; the slack past the buckets is never touched
+	tt->mapped_bytes = (bytes + TT_HUGE_PAGE_BYTES - 1) / TT_HUGE_PAGE_BYTES * TT_HUGE_PAGE_BYTES;
+	tt->buckets = tt_map(tt->mapped_bytes); // Already zero
+	assert(tt->buckets != NULL);
+	//tt->node_thread_counts = malloc(sizeof(uint8_t) * tt->bucket_count);
+	//memset(tt->node_thread_counts, 0, tt->bucket_count * sizeof(uint8_t));
+	//assert(tt->node_thread_counts != NULL);
+	tt->count = 0;
+	tt->generation = 0;
+}
+
+// Invoke to prepare transposition table
+void tt_init(ttable *tt) {
+	assert(zobrist_initialized);
+	uint64_t bucket_count = tt_bucket_count_for(tt->megabytes);
+	uint64_t limit = tt_memory_limit(tt);
+	while (bucket_count > 1 && bucket_count * sizeof(tt_bucket) > limit) bucket_count /= 2;
+	if (tt->buckets != NULL && bucket_count == tt->bucket_count) { // Keep the memory and entries we have
+		tt_clear(tt);
+		return;
+	}
+	tt_free(tt);
+	tt_allocate(tt, bucket_count);
+}
+
+bool tt_resize(ttable *tt, int megabytes, bool keep_entries) {
+	assert(zobrist_initialized);
+	uint64_t bucket_count = tt_bucket_count_for(megabytes);
+	uint64_t bytes = bucket_count * sizeof(tt_bucket), limit = tt_memory_limit(tt);
+	if (bytes > limit) {
+		stdout_fprintf(logstr, "info string a hash of %d MB does not fit in the %llu MB of memory available\n",
+			megabytes, limit / TT_BYTES_IN_MB);
+		return false;
+	}
+	tt->megabytes = megabytes;
+	if (tt->buckets == NULL) {
+		tt_allocate(tt, bucket_count);
+		return true;
+	}
+	if (bucket_count == tt->bucket_count) return true;
+	if (keep_entries && tt->count > 0 && bytes + tt->bucket_count * sizeof(tt_bucket) > limit) {
+		stdout_fprintf(logstr, "info string not enough memory to keep the hash while resizing; clearing it\n");
+		keep_entries = false;
+	}
+	if (!keep_entries || tt->count == 0) {
+		tt_free(tt);
+		tt_allocate(tt, bucket_count);
+		return true;
+	}
+	ttable old = *tt;
+	tt->buckets = NULL;
+	tt->node_thread_counts = NULL;
+	tt_allocate(tt, bucket_count);
+	tt->generation = old.generation;
+	tt_run_jobs(&old, tt, &tt_migrate_entrypoint);
+	tt_free(&old);
+	stdout_fprintf(logstr, "info string migrated the hash: kept %llu of %llu entries\n", tt->count, old.count);
+	return true;
+}
+
+// Release the table's memory; the table must be initialized again before use
+void tt_free(ttable *tt) {
+	if (tt->buckets != NULL) munmap(tt->buckets, tt->mapped_bytes);
+	if (tt->node_thread_counts != NULL) free(tt->node_thread_counts);
+	tt->buckets = NULL;
+	tt->node_thread_counts = NULL;
+}
+
+#define TT_FILE_MAGIC "FIANCHTT"
+#define TT_FILE_VERSION 2 // Change whenever the layout of tt_bucket changes
+
+static tt_file_header tt_file_header_for(ttable *tt) {
+	tt_file_header header;
+	memset(&header, 0, sizeof(header)); // including the padding, which is written out
+	memcpy(header.magic, TT_FILE_MAGIC, sizeof(header.magic));
+	header.version = TT_FILE_VERSION;
+	header.bucket_bytes = sizeof(tt_bucket);
+	header.zobrist_seed = zobrist_seed;
+	header.bucket_count = tt->bucket_count;
+	header.count = tt->count;
+	header.generation = tt->generation;
+	return header;
+}
+
+bool tt_save_file(ttable *tt, const char *path) {
+	assert(tt->buckets != NULL);
+	FILE *f = fopen(path, "wb");
+	if (f == NULL) {
+		stdout_fprintf(logstr, "info string could not open %s to save the hash\n", path);
+		return false;
+	}
+	tt_file_header header = tt_file_header_for(tt);
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1
+		&& fwrite(tt->buckets, sizeof(tt_bucket), tt->bucket_count, f) == tt->bucket_count;
+	ok = (fclose(f) == 0) && ok;
+	if (ok) stdout_fprintf(logstr, "info string saved %llu hash entries to %s\n", tt->count, path);
+	else stdout_fprintf(logstr, "info string failed to write the hash to %s\n", path);
+	return ok;
+}
+
+bool tt_load_file(ttable *tt, const char *path) {
+	assert(tt->buckets != NULL);
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		stdout_fprintf(logstr, "info string could not open hash file %s\n", path);
+		return false;
+	}
+	struct stat st;
+	size_t bytes = tt->bucket_count * sizeof(tt_bucket);
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size != sizeof(tt_file_header) + bytes) {
+		stdout_fprintf(logstr, "info string %s does not hold a hash of this size\n", path);
+		close(fd);
+		return false;
+	}
+	uint8_t *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		stdout_fprintf(logstr, "info string could not map hash file %s\n", path);
+		return false;
+	}
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+	tt_file_header expected = tt_file_header_for(tt);
+	const tt_file_header *header = (const tt_file_header *) data;
+	bool ok = memcmp(header->magic, expected.magic, sizeof(expected.magic)) == 0 && header->version == expected.version
+		&& header->bucket_bytes == expected.bucket_bytes && header->zobrist_seed == expected.zobrist_seed
+		&& header->bucket_count == expected.bucket_count;
+	if (ok) {
+		memcpy(tt->buckets, data + sizeof(tt_file_header), bytes);
+		tt->count = header->count;
+		tt->generation = header->generation;
+		stdout_fprintf(logstr, "info string loaded %llu hash entries from %s\n", tt->count, path);
+	} else {
+		stdout_fprintf(logstr, "info string %s was saved by an incompatible engine or Hash size\n", path);
+	}
+	munmap(data, st.st_size);
+	return ok;
 }
 
 // Hash a board position.
 // Usually, you should use the board's "hash" field instead, which is updated incrementally.
 uint64_t tt_hash_position(board *b) {
-	assert(is_initialized);
+	assert(zobrist_initialized);
 	uint64_t hash = 0;
 	for (uint8_t i = 0; i < 8; i++) {
 		for (uint8_t j = 0; j < 8; j++) {
@@ -123,186 +450,248 @@ uint64_t tt_hash_position(board *b) {
 	return hash;
 }
 
-// Put a new entry in the transposition table.
-// Only replaces under certain conditions, to avoid overwriting a principal variation (PV).
-// Overwrites ancient entries.
-void tt_put(board *b, evaluation e) {
-	assert(is_initialized);
-
-	// If we wanted to clear on the next move
-	if (tt_clear_scheduled && (b->true_game_ply_clock != tt_clear_scheduled_on_move)) {
-		tt_clear();
-		tt_clear_scheduled = false;
-		stdout_fprintf(logstr, "info string transposition table clear performed.\n");
-	}
-
-	if (tt_count >= tt_rehash_count && !tt_clear_scheduled) { // The ttable is overflowing and no clear is already scheduled
-		if (allow_tt_expansion && !tt_expand()) {
-			stdout_fprintf(logstr, "info string failed to expand transposition table from %llu entries; clearing.\n", tt_count);
-			tt_clear();
-			return;
-		}
-		if (!allow_tt_expansion) {
-			stdout_fprintf(logstr, "info string transposition table filled; scheduling a clear\n");
-			tt_clear_scheduled = true;
-			tt_clear_scheduled_on_move = b->true_game_ply_clock;
+uint64_t tt_pawn_hash_position(board *b) {
+	assert(zobrist_initialized);
+	uint64_t hash = 0;
+	for (uint8_t i = 0; i < 8; i++) {
+		for (uint8_t j = 0; j < 8; j++) {
+			hash ^= tt_pawnval(b, (coord){i, j});
 		}
 	}
+	return hash;
+}
 
-	uint64_t idx = b->hash % tt_size;
-	bool overwriting = false;
-
-	// Because we are going to clear the table regardless, we switch to an "always-overwrite" strategy
-	// Specifically, we overwrite any non-enpty slot. We don't touch empty slots to avoid very long tt_get() operations.
-	// This might overwrite random things and destroy the table or PV, but that's OK - presumably
-	// this is only called at deep depths, and the search() caller should handle the starting position
-	// not being in the table.
-	if (tt_clear_scheduled) {
-		if (tt_keys[idx] != 0) goto skipchecks;
-		else {
-			return;
-		}
+// Whether an entry for a position should be replaced by a new result for the same position.
+// Avoids overwriting a principal variation (PV).
+static bool tt_should_replace(search_context *ctx, evaluation old, evaluation e) {
+	// Entries outlive searches, so a deeper result, or any result of this search over one left
+	// from an earlier search, wins whatever the bounds; otherwise a shallow exact entry would
+	// block the position's deeper results for the rest of the game.
+	if (e.depth > old.depth || old.generation != e.generation) return true;
+	// Never replace exact with inexact, or we could easily lose the PV.
+	// only replace qexact with other qexact or exact
+	if ((old.type == exact && e.type != exact) || (old.type == qexact && e.type != qexact && e.type != exact)) {
+		stat_add(&ctx->stats.ttable_insert_failures, 1);
+		return false;
 	}
+	// Always replace inexact with exact;
+	// otherwise, we might fail to replace a cutoff with a "shallow" ending of a PV.
+	if (old.type != exact && e.type == exact) return true;
+	if (old.type != qexact && e.type == qexact) return true;
+	// Otherwise, prefer deeper entries; replace if equally deep due to aspiration windows
+	// TODO keeping the deepest entry aappears to caue blunders? Maybe collisions are responsible? Really odd.
+	return e.depth >= old.depth;
+}
 
-	while (tt_keys[idx] != 0 && tt_keys[idx] != b->hash) {
-		if (b->true_game_ply_clock - tt_values[idx].last_access_move >= remove_at_age) {
-			overwriting = true;
-			break;
-		}
-		idx = (idx + 1) % tt_size;
+// How much an entry is worth keeping; a new position replaces the least valuable entry of its bucket
+static inline int tt_entry_worth(uint16_t key, evaluation value, uint8_t generation) {
+	if (key == 0) return INT_MIN; // empty
+	int age = (uint8_t) (generation - value.generation); // wrong only for entries unused in 256 searches
+	if (age >= remove_at_age) return INT_MIN + 1; // ancient
+	int worth = value.depth - tt_age_weight * age;
+	if (value.type == exact || value.type == qexact) worth += tt_exact_bonus;
+	return worth;
+}
+
+/*
+ * Telemetry
+ */
+
+static inline int tt_telemetry_depth(int depth) {
+	return min(max(depth, 0), TT_TELEMETRY_DEPTHS - 1);
+}
+
+// Record what a store of a new position replaced
+static void tt_telemetry_store(search_context *ctx, uint16_t victim_key, evaluation victim, int victim_worth) {
+	tt_telemetry *t = &ctx->telemetry;
+	if (victim_key == 0) {
+		stat_add(&t->fills, 1);
+		return;
 	}
+	stat_add(&t->evictions[victim.type], 1);
+	stat_add(&t->eviction_depths[tt_telemetry_depth(victim.depth)], 1);
+	if (victim_worth == INT_MIN + 1) stat_add(&t->aged_evictions, 1);
+}
 
-	// We found our entry; lock it
-	//pthread_mutex_lock(tt_locks + idx);
+void tt_telemetry_probe(search_context *ctx, int ply, evaluation stored) {
+	tt_telemetry *t = &ctx->telemetry;
+	int d = tt_telemetry_depth(ply);
+	stat_add(&t->probes[d], 1);
+	if (e_eq(stored, no_eval)) return;
+	stat_add(&t->hits[d], 1);
+	if (stored.depth >= ply) stat_add(&t->deep_hits[d], 1);
+}
 
-	// If it is a new entry, skip the replacement checks
-	if (tt_keys[idx] == 0 || overwriting) goto skipchecks;
+void tt_telemetry_clear(search_context *ctx) {
+	uint64_t *counters = (uint64_t *) &ctx->telemetry;
+	for (size_t i = 0; i < sizeof(tt_telemetry) / sizeof(uint64_t); i++) stat_set(counters + i, 0);
+}
 
-	// TODO did it play better with this commented out?
-	// Never replace exact with inexact, or we could easily lose the PV.
-	if (tt_values[idx].type == exact && e.type != exact) {
-		sstats.ttable_insert_failures++;
-		//pthread_mutex_unlock(tt_locks + idx);
+// Append the counters, space separated, to line
+static void tt_telemetry_append(char *line, size_t length, const uint64_t *counters, int count) {
+	for (int i = 0; i < count; i++) {
+		size_t used = strlen(line);
+		snprintf(line + used, length - used, " %llu", (unsigned long long) counters[i]);
+	}
+}
+
+static void tt_telemetry_line(const char *line, bool uci) {
+	if (uci) stdout_fprintf(logstr, "info string %s\n", line);
+	else printf("\t%s\n", line);
+}
+
+void tt_telemetry_print(search_context *ctx, bool uci) {
+	if (!use_tt_telemetry) {
+		tt_telemetry_line("tt telemetry is compiled out; enable use_tt_telemetry in settings.h", uci);
 		return;
 	}
-	// only replace qexact with other qexact or exact
-	if (tt_values[idx].type == qexact) {
-		if (e.type != qexact && e.type != exact) {
-			sstats.ttable_insert_failures++;
-			//pthread_mutex_unlock(tt_locks + idx);
+	tt_telemetry *t = &ctx->telemetry;
+	char line[max_input_string_length];
+	snprintf(line, sizeof(line), "tt hits by bucket entry:");
+	tt_telemetry_append(line, sizeof(line), t->hit_slots, TT_BUCKET_ENTRIES);
+	size_t used = strlen(line);
+	snprintf(line + used, sizeof(line) - used, "; key collisions %llu", (unsigned long long) t->key_collisions);
+	tt_telemetry_line(line, uci);
+
+	// Evaltypes in enum order: upperbound, lowerbound, qupperbound, qlowerbound, exact, qexact
+	snprintf(line, sizeof(line), "tt same-position stores by stored type (u l qu ql e qe): updated");
+	tt_telemetry_append(line, sizeof(line), t->updates, 6);
+	used = strlen(line);
+	snprintf(line + used, sizeof(line) - used, "; refused");
+	tt_telemetry_append(line, sizeof(line), t->refusals, 6);
+	tt_telemetry_line(line, uci);
+
+	snprintf(line, sizeof(line), "tt new-position stores: %llu fills, %llu aged evictions; evictions by type",
+		(unsigned long long) t->fills, (unsigned long long) t->aged_evictions);
+	tt_telemetry_append(line, sizeof(line), t->evictions, 6);
+	used = strlen(line);
+	snprintf(line + used, sizeof(line) - used, "; by depth 0-%d+", TT_TELEMETRY_DEPTHS - 1);
+	tt_telemetry_append(line, sizeof(line), t->eviction_depths, TT_TELEMETRY_DEPTHS);
+	tt_telemetry_line(line, uci);
+
+	snprintf(line, sizeof(line), "tt hit rate by remaining depth (hits deep enough/hits/probes):");
+	for (int d = 0; d < TT_TELEMETRY_DEPTHS; d++) {
+		if (t->probes[d] == 0) continue;
+		used = strlen(line);
+		snprintf(line + used, sizeof(line) - used, " d%d%s %llu/%llu/%llu (%.1f%%)", d, d == TT_TELEMETRY_DEPTHS - 1 ? "+" : "",
+			(unsigned long long) t->deep_hits[d], (unsigned long long) t->hits[d], (unsigned long long) t->probes[d],
+			100.0 * t->hits[d] / t->probes[d]);
+	}
+	tt_telemetry_line(line, uci);
+}
+
+// Put a new entry in the transposition table.
+// Only replaces an entry for the same position under certain conditions, to avoid overwriting a
+// principal variation (PV). Otherwise, replaces the least valuable entry of the bucket.
+void tt_put(search_context *ctx, board *b, evaluation e) {
+	ttable *tt = ctx->tt;
+	assert(tt->buckets != NULL);
+	tt_bucket *bucket = tt->buckets + tt_bucket_index(tt, b->hash);
+	uint16_t key = tt_key(b->hash);
+	e.generation = tt->generation;
+
+	int victim = 0;
+	uint16_t victim_key = 0;
+	evaluation victim_value = no_eval;
+	int victim_worth = INT_MAX;
+	for (int i = 0; i < TT_BUCKET_ENTRIES; i++) {
+		uint64_t data;
+		uint16_t stored_key = tt_entry_load(bucket, i, &data);
+		evaluation stored = tt_unpack(data);
+		if (stored_key == key) { // Already stored
+			bool replace = tt_should_replace(ctx, stored, e);
+			if (use_tt_telemetry) stat_add(replace ? &ctx->telemetry.updates[stored.type] : &ctx->telemetry.refusals[stored.type], 1);
+			if (!replace) return;
+			tt_entry_store(bucket, i, key, tt_pack(e));
+			stat_add(&ctx->stats.ttable_inserts, 1);
 			return;
 		}
+		int worth = tt_entry_worth(stored_key, stored, tt->generation);
+		if (worth < victim_worth) {
+			victim = i;
+			victim_key = stored_key;
+			victim_value = stored;
+			victim_worth = worth;
+		}
 	}
-	// Always replace inexact with exact;
-	// otherwise, we might fail to replace a cutoff with a "shallow" ending of a PV.
-	if (tt_values[idx].type != exact && e.type == exact) goto skipchecks;
-	if (tt_values[idx].type != qexact && e.type == qexact) goto skipchecks;
-	if (tt_values[idx].type != qexact && e.type == exact) goto skipchecks;
-	// Otherwise, prefer deeper entries; replace if equally deep due to aspiration windows
-	if (e.depth < tt_values[idx].depth) {
-		//sstats.ttable_insert_failures++; 
-		// TODO keeping the deepest entry aappears to caue blunders? Maybe collisions are responsible? Really odd.
-		//pthread_mutex_unlock(tt_locks + idx);
-		return;
-	}
-	skipchecks:
-	e.last_access_move = b->true_game_ply_clock;
-	tt_values[idx] = e;
-	if (!overwriting) tt_count++;
-	else sstats.ttable_overwrites++;
-	sstats.ttable_inserts++;
-	tt_keys[idx] = b->hash; // Write the key at the end so tt_get will never read an incomplete entry
-	//pthread_mutex_unlock(tt_locks + idx);
+	if (use_tt_telemetry) tt_telemetry_store(ctx, victim_key, victim_value, victim_worth);
+	if (victim_key == 0) __atomic_add_fetch(&tt->count, 1, __ATOMIC_RELAXED);
+	else stat_add(&ctx->stats.ttable_overwrites, 1);
+	stat_add(&ctx->stats.ttable_inserts, 1);
+	tt_entry_store(bucket, victim, key, tt_pack(e));
 }
 
 // Fetch an entry from the transposition table.
-void tt_get(board *b, evaluation *result) {
-	assert(is_initialized);
-	uint64_t idx = b->hash % tt_size;
-	while (tt_keys[idx] != 0 && tt_keys[idx] != b->hash) {
-		idx = (idx + 1) % tt_size;
-	}
-	if (tt_keys[idx] == 0) {
-		sstats.ttable_misses++;
-		*result = no_eval;
+void tt_get(search_context *ctx, board *b, evaluation *result) {
+	ttable *tt = ctx->tt;
+	assert(tt->buckets != NULL);
+	tt_bucket *bucket = tt->buckets + tt_bucket_index(tt, b->hash);
+	uint16_t key = tt_key(b->hash);
+	for (int i = 0; i < TT_BUCKET_ENTRIES; i++) {
+		uint64_t data;
+		if (tt_entry_load(bucket, i, &data) != key) continue;
+		evaluation stored = tt_unpack(data);
+		if (!tt_unpack_move(b, (uint16_t) data, &stored.best)) { // Another position's entry
+			if (use_tt_telemetry) stat_add(&ctx->telemetry.key_collisions, 1);
+			continue;
+		}
+		if (use_tt_telemetry) stat_add(&ctx->telemetry.hit_slots[i], 1);
+		if (stored.generation != tt->generation) { // Refresh the age once per search
+			stored.generation = tt->generation;
+			tt_entry_store(bucket, i, key, (data & ~(0xFFULL << 40)) | (uint64_t) tt->generation << 40);
+		}
+		stat_add(&ctx->stats.ttable_hits, 1);
+		*result = stored;
 		return;
 	}
-	// TODO is locking necessary?
-	//pthread_mutex_lock(tt_locks + idx);
-	tt_values[idx].last_access_move = b->true_game_ply_clock;
-	sstats.ttable_hits++;
-	*result = tt_values[idx];
-	//pthread_mutex_unlock(tt_locks + idx);
+	stat_add(&ctx->stats.ttable_misses, 1);
+	*result = no_eval;
 }
 
-// Clear the transposition table (by resetting it).
-void tt_clear() {
-	assert(is_initialized);
-	tt_init();
+void tt_new_search(ttable *tt) {
+	tt->generation++;
 }
 
-bool tt_try_to_claim_node(board *b, int *id) {
-	assert(is_initialized);
-	uint64_t idx = b->hash % tt_size;
-	while (tt_keys[idx] != 0 && tt_keys[idx] != b->hash) {
-		idx = (idx + 1) % tt_size;
-	}
-	//pthread_mutex_lock(tt_locks + idx);
-	//bool success = __sync_bool_compare_and_swap(tt_node_thread_counts + idx, zero, one);
-	if (tt_node_thread_counts[idx] != 0) {
-		//pthread_mutex_unlock(tt_locks + idx);
-		return false;
-	}
-	tt_node_thread_counts[idx]++;
+// Age every entry past remove_at_age, so that any new position replaces it
+void tt_clear(ttable *tt) {
+	assert(tt->buckets != NULL);
+	tt->generation += remove_at_age;
+}
+
+// Erase the table in place
+void tt_wipe(ttable *tt) {
+	assert(tt->buckets != NULL);
+	if (tt->count == 0) return; // Nothing has been stored since the last wipe
+	tt_zero(tt);
+	tt->count = 0;
+}
+
+// Nodes are claimed by bucket, so positions sharing a bucket share a claim
+bool tt_try_to_claim_node(ttable *tt, board *b, int *id) {
+	assert(tt->buckets != NULL);
+	uint64_t idx = tt_bucket_index(tt, b->hash);
+	//bool success = __sync_bool_compare_and_swap(tt->node_thread_counts + idx, zero, one);
+	if (tt->node_thread_counts[idx] != 0) return false;
+	tt->node_thread_counts[idx]++;
 	*id = idx;
 	return true;
 }
 
-void tt_always_claim_node(board *b, int *id) {
-	assert(is_initialized);
-	uint64_t idx = b->hash % tt_size;
-	while (tt_keys[idx] != 0 && tt_keys[idx] != b->hash) {
-		idx = (idx + 1) % tt_size;
-	}
-	//pthread_mutex_lock(tt_locks + idx);
-	tt_node_thread_counts[idx]++;
+void tt_always_claim_node(ttable *tt, board *b, int *id) {
+	assert(tt->buckets != NULL);
+	uint64_t idx = tt_bucket_index(tt, b->hash);
+	tt->node_thread_counts[idx]++;
 	*id = idx;
 }
 
 // Unclaims a node for a given id.
-void tt_unclaim_node(int id) {
-	tt_node_thread_counts[id]--;
-	//pthread_mutex_unlock(tt_locks + id);
-}
-
-// Expand the table. This won't be called unless the appropriate setting is activated in the .h file.
-bool tt_expand(void) {
-	assert(false); // TODO this no longer works
-	assert(is_initialized);
-	stdout_fprintf(logstr, "expanding transposition table...\n");
-	uint64_t new_size = tt_size * 2;
-	uint64_t *new_keys = malloc(sizeof(uint64_t) * new_size);
-	evaluation *new_values = malloc(sizeof(evaluation) * new_size);
-	if (new_keys == NULL || new_values == NULL) return false;
-	memset(new_keys, 0, new_size * sizeof(uint64_t)); // zero out keys
-	for (uint64_t i = 0; i < tt_size; i++) { // for every old index
-		if (tt_keys[i] == 0) continue; // skip empty slots
-		uint64_t new_idx = tt_keys[i] % new_size;
-		new_keys[new_idx] = tt_keys[i];
-		new_values[new_idx] = tt_values[i];
-	}
-	free(tt_keys);
-	free(tt_values);
-	tt_keys = new_keys;
-	tt_values = new_values;
-	tt_size = new_size;
-	tt_rehash_count = (uint64_t) (ceil(tt_max_load * new_size));
-	return true;
+void tt_unclaim_node(ttable *tt, int id) {
+	tt->node_thread_counts[id]--;
 }
 
 // Get the Zobrist hash value of a piece at a board location.
 uint64_t tt_pieceval(board *b, coord c) {
-	assert(is_initialized);
+	assert(zobrist_initialized);
 	int piece_code = 0;
 	piece p = at(b, c);
 	if (p_eq(p, no_piece)) return 0;
@@ -318,3 +707,8 @@ uint64_t tt_pieceval(board *b, coord c) {
 	}
 	return zobrist[square_code(c)][piece_code];
 }
+
+uint64_t tt_pawnval(board *b, coord c) {
+	if (at(b, c).type != 'P') return 0;
+	return tt_pieceval(b, c);
+}
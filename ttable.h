@@ -2,6 +2,8 @@
 #define TTABLE_H
 
 #include <assert.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <math.h>
 #include <pthread.h>
 #include <stdbool.h>
@@ -9,7 +11,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <time.h>
+#include <unistd.h>
 #include "settings.h"
 #include "search.h"
 #include "types.h"
@@ -18,55 +23,110 @@
 /**
  * Transposition Table Public API
  *
- * The Transposition Table is a hashtable that stores previously evaluated positions.
+ * The Transposition Table is a hashtable that stores previously evaluated positions. Each hash
+ * selects a cache-line bucket of TT_BUCKET_ENTRIES entries; a new position replaces the entry of
+ * the bucket least worth keeping, judged by depth, age and bound type. Age is counted in
+ * searches: each entry records the 8-bit generation of the last search to store or find it.
  */
 
+// The bucket a hash selects
+static inline uint64_t tt_bucket_index(ttable *tt, uint64_t hash) {
+	return hash & (tt->bucket_count - 1); // a power of two
+}
+
+// Start loading the bucket of a position into the cache, so that a probe soon after does not wait
+static inline void tt_prefetch(ttable *tt, uint64_t hash) {
+	__builtin_prefetch(tt->buckets + tt_bucket_index(tt, hash));
+}
+
 // Fetch usage data about the table
-uint64_t get_tt_count(void);
-uint64_t get_tt_size(void);
+uint64_t get_tt_count(ttable *tt);
+uint64_t get_tt_size(ttable *tt);
+
+// Return the percentage of the table used by the current search, estimated from a sample of
+// entries; entries left over from earlier searches do not count
+double tt_load(ttable *tt);
+
+// Populate the Zobrist keys from zobrist_seed, so that they are the same in every run. Must be
+// called once before any board is hashed.
+void zobrist_init(void);
 
-// Return the percentage of the table that is used
-double tt_load(void);
+// Initialize (or reinitialize) a transposition table of tt->megabytes. Must be called before use.
+// A table that already has that size is cleared in place rather than reallocated. The size is
+// rounded down to a power of two buckets, and to the memory available.
+void tt_init(ttable *tt);
 
-// Initialize the transposition table. Must be called before use.
-void tt_init(void);
+// Change the table's size to megabytes (rounded down as in tt_init), moving the entries to the
+// new table if keep_entries is set. Refuses, returning false, a size larger than the memory
+// available without swapping (counting the table's own) or the container's memory limit.
+bool tt_resize(ttable *tt, int megabytes, bool keep_entries);
+
+// Release a table's memory.
+void tt_free(ttable *tt);
+
+// Write the table to a file, after a header recording the entry format, the Zobrist seed and the
+// table size. Returns false on failure.
+bool tt_save_file(ttable *tt, const char *path);
+
+// Replace the table's contents with a file written by tt_save_file for a table of the same size.
+// Returns false, leaving the table unchanged, if the file cannot be read or does not match.
+bool tt_load_file(ttable *tt, const char *path);
 
 // Generate the expected hash value of a board.
 // Typically, use the board struct's hash field instead.
 uint64_t tt_hash_position(board *b);
 
-// Add or update a board in the transposition table.
-void tt_put(board *b, evaluation e);
+// Add or update a board in the context's transposition table.
+void tt_put(search_context *ctx, board *b, evaluation e);
 
-// Fetch an evaluation from the table. Populates with no_eval if not found.
+// Fetch an evaluation from the context's table. Populates with no_eval if not found.
 // This pointer does not actually point into the table.
-void tt_get(board *b, evaluation *result);
+void tt_get(search_context *ctx, board *b, evaluation *result);
+
+// Start a new search generation. Call before each search; entries the search does not touch age.
+void tt_new_search(ttable *tt);
 
-// Clears the transposition table (by resetting it).
-void tt_clear(void);
+// Clears the transposition table in constant time, by aging every entry so that it is replaced
+// first. Entries can still be found until they are replaced, so use tt_wipe if they are wrong.
+void tt_clear(ttable *tt);
+
+// Erase every entry, zeroing the table with several threads. For when stored scores no longer
+// hold, such as after the evaluation changes.
+void tt_wipe(ttable *tt);
+
+// With use_tt_telemetry, record a probe by a node with ply remaining and what it found
+void tt_telemetry_probe(search_context *ctx, int ply, evaluation stored);
+
+// Zero the context's telemetry, before a search
+void tt_telemetry_clear(search_context *ctx);
+
+// Print the context's telemetry, as info strings for UCI or as indented lines for the console
+void tt_telemetry_print(search_context *ctx, bool uci);
 
 // For parallel search. Marks a node as exclusively belonging to a specific thread.
 // Returns true if the node was claimed, and populates the id.
-bool tt_try_to_claim_node(board *b, int *id);
+bool tt_try_to_claim_node(ttable *tt, board *b, int *id);
 
-void tt_always_claim_node(board *b, int *id);
+void tt_always_claim_node(ttable *tt, board *b, int *id);
 
 // Unclaims a node for a given id.
-void tt_unclaim_node(int id);
+void tt_unclaim_node(ttable *tt, int id);
+
+// Generate the expected pawn hash of a board; typically, use the board's pawn_hash field instead.
+uint64_t tt_pawn_hash_position(board *b);
 
 // Get the Zobrist hash value of a piece.
 uint64_t tt_pieceval(board *b, coord c);
 
+// As tt_pieceval, but zero for anything other than a pawn.
+uint64_t tt_pawnval(board *b, coord c);
+
 /**
  * Constants and settings
  */
 
-// starting size of table, and whether expansion is allowed
+// starting size of table
 extern int tt_megabytes; // Don't set a value here 
-static bool allow_tt_expansion = false;
-extern bool search_terminate_requested;
-// Re-hash at 70% load factor
-
 
 // Randomly selected zobrist values used to hash board state
 extern uint64_t zobrist[64][12]; // zobrist table for pieces
@@ -77,9 +137,5 @@ extern uint64_t zobrist_castle_bk;
 extern uint64_t zobrist_black_to_move;
 extern uint64_t zobrist_en_passant_files[8];
 
-// Used to keep track of when the table will actually be cleared
-static int tt_clear_scheduled_on_move = -1;
-static bool tt_clear_scheduled = false;
-
 
 #endif
@@ -0,0 +1,351 @@
+#include <ctype.h>
+#include <math.h>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include "tuner.h"
+#include "evaluate.h"
+#include "movegen.h"
+#include "search.h"
+#include "ttable.h"
+
+#define TUNE_MAX_THREADS 256
+#define TUNE_QSEARCH_HEIGHT 32
+
+typedef struct tune_entry {
+	eval_terms terms; // of the quiet position reached from the labeled one
+	float result; // 1 for a white win, 0.5 for a draw, 0 for a loss
+	bool valid;
+} tune_entry;
+
+// Work shared by the tuner threads
+typedef struct tune_job {
+	char **lines;
+	tune_entry *entries;
+	int count;
+	int num_threads;
+	const double *params;
+	double k;
+	bool want_gradient;
+} tune_job;
+
+typedef struct tune_worker {
+	tune_job *job;
+	int id;
+	double error;
+	double gradient[EVAL_PARAM_COUNT];
+	// Capture search state
+	move moves[TUNE_QSEARCH_HEIGHT][MAX_MOVES];
+	move pv[TUNE_QSEARCH_HEIGHT][TUNE_QSEARCH_HEIGHT];
+	int pv_length[TUNE_QSEARCH_HEIGHT];
+	int8_t en_passant_history[400];
+} tune_worker;
+
+/*
+ * Loading positions
+ */
+
+// Parse the position and result from one line. Thread-safe, unlike read_from_fen.
+static bool parse_line(const char *line, board *b, int8_t *en_passant_history, float *result) {
+	memset(b, 0, sizeof(board));
+	const char *p = line;
+	for (int row = 7; row >= 0; row--) {
+		int col = 0;
+		for (; *p != '\0' && *p != '/' && *p != ' '; p++) {
+			if (*p >= '1' && *p <= '8') {
+				for (int k = 0; k < *p - '0' && col < 8; k++) b->b[col++][row] = no_piece;
+			} else if (strchr("pnbrqkPNBRQK", *p) != NULL && col < 8) {
+				b->b[col++][row] = (piece){(char) toupper(*p), !(*p >= 'a')};
+			} else return false;
+		}
+		if (col != 8) return false;
+		if (row > 0 && *p++ != '/') return false;
+	}
+	if (*p++ != ' ') return false;
+	if (*p != 'w' && *p != 'b') return false;
+	b->black_to_move = (*p++ == 'b');
+	while (*p == ' ') p++;
+	for (; *p != '\0' && *p != ' '; p++) {
+		if (*p == 'K') b->castle_rights_wk = true;
+		else if (*p == 'Q') b->castle_rights_wq = true;
+		else if (*p == 'k') b->castle_rights_bk = true;
+		else if (*p == 'q') b->castle_rights_bq = true;
+	}
+
+	if (strstr(p, "1/2-1/2") != NULL) *result = 0.5f;
+	else if (strstr(p, "1-0") != NULL) *result = 1.0f;
+	else if (strstr(p, "0-1") != NULL) *result = 0.0f;
+	else if (strchr(p, '[') != NULL) *result = (float) atof(strchr(p, '[') + 1);
+	else return false;
+
+	b->castle_wq_lost_on_ply = b->castle_wk_lost_on_ply = -1;
+	b->castle_bq_lost_on_ply = b->castle_bk_lost_on_ply = -1;
+	// The evaluation keeps at most 32 pieces' terms, and needs exactly one king a side
+	int pieces = 0, white_kings = 0, black_kings = 0;
+	for (uint8_t i = 0; i < 8; i++) {
+		for (uint8_t j = 0; j < 8; j++) {
+			if (p_eq(b->b[i][j], no_piece)) continue;
+			pieces++;
+			if (b->b[i][j].type != 'K') continue;
+			if (b->b[i][j].white) b->white_king = (coord){i, j}, white_kings++;
+			else b->black_king = (coord){i, j}, black_kings++;
+		}
+	}
+	if (pieces > 32 || white_kings != 1 || black_kings != 1) return false;
+	b->en_passant_pawn_push_col_history = en_passant_history;
+	en_passant_history[0] = -1;
+	b->hash = tt_hash_position(b);
+	b->pawn_hash = tt_pawn_hash_position(b);
+	eval_refresh(b);
+	return true;
+}
+
+// Capture-only search from the side to move's perspective, recording its principal variation
+static int quiesce(tune_worker *w, board *b, int alpha, int beta, int height) {
+	w->pv_length[height] = 0;
+	int stand_pat = evaluate(b);
+	if (b->black_to_move) stand_pat = -stand_pat;
+	if (stand_pat >= beta || height == TUNE_QSEARCH_HEIGHT - 1) return stand_pat;
+	alpha = max(alpha, stand_pat);
+
+	move *moves = w->moves[height];
+	int count = 0;
+	board_moves_into(b, moves, &count, true);
+	for (int i = 0; i < count; i++) {
+		// Selection sort by MVV-LVA, one move at a time, since cutoffs are common
+		int best = i;
+		for (int j = i + 1; j < count; j++) {
+			if (capture_score(b, &moves[j]) > capture_score(b, &moves[best])) best = j;
+		}
+		move m = moves[best];
+		moves[best] = moves[i];
+		moves[i] = m;
+		apply(b, moves[i]);
+		coord king = b->black_to_move ? b->white_king : b->black_king; // for side that just moved
+		if (in_check(b, king.col, king.row, !(b->black_to_move))) {
+			unapply(b, moves[i]);
+			continue;
+		}
+		int score = -quiesce(w, b, -beta, -alpha, height + 1);
+		unapply(b, moves[i]);
+		if (score <= alpha) continue;
+		alpha = score;
+		w->pv[height][0] = moves[i];
+		memcpy(w->pv[height] + 1, w->pv[height + 1], sizeof(move) * w->pv_length[height + 1]);
+		w->pv_length[height] = w->pv_length[height + 1] + 1;
+		if (alpha >= beta) break;
+	}
+	return alpha;
+}
+
+static void *load_entrypoint(void *arg) {
+	tune_worker *w = arg;
+	tune_job *job = w->job;
+	board b;
+	for (int i = w->id; i < job->count; i += job->num_threads) {
+		tune_entry *e = job->entries + i;
+		e->valid = parse_line(job->lines[i], &b, w->en_passant_history, &e->result);
+		if (!e->valid) continue;
+		quiesce(w, &b, -POS_INFINITY, POS_INFINITY, 0);
+		for (int j = 0; j < w->pv_length[0]; j++) apply(&b, w->pv[0][j]);
+		eval_get_terms(&b, &e->terms);
+	}
+	return NULL;
+}
+
+/*
+ * Error and gradient
+ */
+
+// The evaluation of a position's terms from white's perspective, before rounding
+static inline double linear_eval(const eval_terms *t, const double *params) {
+	double mg = 0, eg = 0;
+	for (int i = 0; i < 5; i++) {
+		mg += t->material[i] * params[EVAL_PARAM_MG_MATERIAL + i];
+		eg += t->material[i] * params[EVAL_PARAM_EG_MATERIAL + i];
+	}
+	for (int i = 0; i < t->table_count; i++) {
+		int idx = abs(t->tables[i]) - 1;
+		double sign = t->tables[i] > 0 ? 1 : -1;
+		mg += sign * params[EVAL_PARAM_MG_TABLES + idx];
+		eg += sign * params[EVAL_PARAM_EG_TABLES + idx];
+	}
+	double rho = (double) t->phase / max_phase;
+	return mg * rho + eg * (1 - rho) - t->doubled_pawns * params[EVAL_PARAM_DOUBLED_PAWN]
+		+ t->bishop_pair * params[EVAL_PARAM_BISHOP_PAIR];
+}
+
+static inline double sigmoid(double k, double eval) {
+	return 1.0 / (1.0 + exp(-k * eval * (M_LN10 / 400.0)));
+}
+
+static void *error_entrypoint(void *arg) {
+	tune_worker *w = arg;
+	tune_job *job = w->job;
+	const double *params = job->params;
+	w->error = 0;
+	if (job->want_gradient) memset(w->gradient, 0, sizeof(w->gradient));
+	int first = (int) ((long) job->count * w->id / job->num_threads);
+	int last = (int) ((long) job->count * (w->id + 1) / job->num_threads);
+	for (int i = first; i < last; i++) { // Contiguous blocks, to stream through memory
+		tune_entry *e = job->entries + i;
+		if (!e->valid) continue;
+		const eval_terms *t = &e->terms;
+		double s = sigmoid(job->k, linear_eval(t, params));
+		double diff = e->result - s;
+		w->error += diff * diff;
+		if (!job->want_gradient) continue;
+		// d(error)/d(eval); the constant factors are left to the optimizer's step size
+		double g = -diff * s * (1 - s);
+		double rho = (double) t->phase / max_phase;
+		for (int j = 0; j < 5; j++) {
+			w->gradient[EVAL_PARAM_MG_MATERIAL + j] += g * rho * t->material[j];
+			w->gradient[EVAL_PARAM_EG_MATERIAL + j] += g * (1 - rho) * t->material[j];
+		}
+		for (int j = 0; j < t->table_count; j++) {
+			int idx = abs(t->tables[j]) - 1;
+			double sign = t->tables[j] > 0 ? 1 : -1;
+			w->gradient[EVAL_PARAM_MG_TABLES + idx] += g * rho * sign;
+			w->gradient[EVAL_PARAM_EG_TABLES + idx] += g * (1 - rho) * sign;
+		}
+		w->gradient[EVAL_PARAM_DOUBLED_PAWN] -= g * t->doubled_pawns;
+		w->gradient[EVAL_PARAM_BISHOP_PAIR] += g * t->bishop_pair;
+	}
+	return NULL;
+}
+
+static void run_workers(tune_job *job, tune_worker *workers, void *(*entrypoint)(void *)) {
+	pthread_t threads[TUNE_MAX_THREADS];
+	for (int i = 0; i < job->num_threads; i++) {
+		if (pthread_create(&threads[i], NULL, entrypoint, workers + i)) {
+			stdout_fprintf(logstr, "info string error creating tuner thread\n");
+			exit(1);
+		}
+	}
+	for (int i = 0; i < job->num_threads; i++) pthread_join(threads[i], NULL);
+}
+
+// Mean squared error over all valid positions; sums the gradient into gradient if it is not NULL
+static double total_error(tune_job *job, tune_worker *workers, int valid, double *gradient) {
+	job->want_gradient = (gradient != NULL);
+	run_workers(job, workers, error_entrypoint);
+	double error = 0;
+	if (gradient != NULL) memset(gradient, 0, sizeof(double) * EVAL_PARAM_COUNT);
+	for (int i = 0; i < job->num_threads; i++) {
+		error += workers[i].error;
+		if (gradient == NULL) continue;
+		for (int j = 0; j < EVAL_PARAM_COUNT; j++) gradient[j] += workers[i].gradient[j];
+	}
+	return error / valid;
+}
+
+/*
+ * Driver
+ */
+
+static char *read_file(const char *path, long *length) {
+	FILE *f = fopen(path, "rb");
+	if (f == NULL) return NULL;
+	fseek(f, 0, SEEK_END);
+	*length = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	char *data = malloc(*length + 1);
+	if (data == NULL || fread(data, 1, *length, f) != (size_t) *length) {
+		free(data);
+		fclose(f);
+		return NULL;
+	}
+	data[*length] = '\0';
+	fclose(f);
+	return data;
+}
+
+bool tune(const char *positions_path, const char *header_path, int epochs) {
+	long length;
+	char *data = read_file(positions_path, &length);
+	if (data == NULL) {
+		stdout_fprintf(logstr, "info string could not read %s\n", positions_path);
+		return false;
+	}
+	int count = 0;
+	for (long i = 0; i < length; i++) if (data[i] == '\n') count++;
+	char **lines = malloc(sizeof(char *) * (count + 1));
+	count = 0;
+	for (char *line = strtok(data, "\r\n"); line != NULL; line = strtok(NULL, "\r\n")) lines[count++] = line;
+
+	tune_job job = {.lines = lines, .count = count};
+	job.num_threads = (int) max(1, min(TUNE_MAX_THREADS, (int) sysconf(_SC_NPROCESSORS_ONLN)));
+	job.entries = malloc(sizeof(tune_entry) * max(1, count));
+	tune_worker *workers = malloc(sizeof(tune_worker) * job.num_threads);
+	assert(lines != NULL && job.entries != NULL && workers != NULL);
+	for (int i = 0; i < job.num_threads; i++) {
+		workers[i].job = &job;
+		workers[i].id = i;
+	}
+
+	// Resolve every position to a quiet one with the current evaluation
+	stdout_fprintf(logstr, "info string tuner: resolving %d positions on %d threads\n", count, job.num_threads);
+	run_workers(&job, workers, load_entrypoint);
+	int valid = 0;
+	for (int i = 0; i < count; i++) valid += job.entries[i].valid;
+	stdout_fprintf(logstr, "info string tuner: %d positions usable\n", valid);
+	bool success = false;
+	if (valid == 0) goto done;
+
+	int initial[EVAL_PARAM_COUNT];
+	double params[EVAL_PARAM_COUNT];
+	eval_get_params(initial);
+	for (int i = 0; i < EVAL_PARAM_COUNT; i++) params[i] = initial[i];
+	job.params = params;
+
+	// Fit the sigmoid's scale to the current evaluation first
+	double lo = 0.1, hi = 3.0;
+	for (int i = 0; i < 40; i++) {
+		double m1 = lo + (hi - lo) / 3, m2 = hi - (hi - lo) / 3;
+		job.k = m1;
+		double e1 = total_error(&job, workers, valid, NULL);
+		job.k = m2;
+		double e2 = total_error(&job, workers, valid, NULL);
+		if (e1 < e2) hi = m2;
+		else lo = m1;
+	}
+	job.k = (lo + hi) / 2;
+	stdout_fprintf(logstr, "info string tuner: k %.4f error %.6f\n", job.k, total_error(&job, workers, valid, NULL));
+
+	// Adam, over the whole set at every step
+	static double gradient[EVAL_PARAM_COUNT], m[EVAL_PARAM_COUNT], v[EVAL_PARAM_COUNT];
+	const double rate = 1.0, beta1 = 0.9, beta2 = 0.999, epsilon = 1e-8;
+	for (int epoch = 1; epoch <= epochs; epoch++) {
+		double error = total_error(&job, workers, valid, gradient);
+		for (int i = 0; i < EVAL_PARAM_COUNT; i++) {
+			double g = gradient[i] / valid;
+			m[i] = beta1 * m[i] + (1 - beta1) * g;
+			v[i] = beta2 * v[i] + (1 - beta2) * g * g;
+			double m_hat = m[i] / (1 - pow(beta1, epoch));
+			double v_hat = v[i] / (1 - pow(beta2, epoch));
+			params[i] -= rate * m_hat / (sqrt(v_hat) + epsilon);
+		}
+		if (epoch % 50 == 0 || epoch == epochs) {
+			stdout_fprintf(logstr, "info string tuner: epoch %d error %.6f\n", epoch, error);
+		}
+	}
+
+	int tuned[EVAL_PARAM_COUNT];
+	for (int i = 0; i < EVAL_PARAM_COUNT; i++) tuned[i] = (int) lround(params[i]);
+	FILE *f = fopen(header_path, "w");
+	if (f == NULL) {
+		stdout_fprintf(logstr, "info string could not write %s\n", header_path);
+		goto done;
+	}
+	eval_write_params(f, tuned);
+	fclose(f);
+	stdout_fprintf(logstr, "info string tuner: wrote %s\n", header_path);
+	success = true;
+
+done:
+	free(workers);
+	free(job.entries);
+	free(lines);
+	free(data);
+	return success;
+}
@@ -0,0 +1,25 @@
+#ifndef TUNER_H
+#define TUNER_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include "settings.h"
+#include "types.h"
+#include "util.h"
+
+/**
+ * Texel Tuner Public API
+ *
+ * Tunes the hand-written evaluation against a file of labeled positions, one per line: a FEN or
+ * EPD position followed by the game result, as "1-0", "0-1" or "1/2-1/2" (optionally quoted, as
+ * in c9 "1-0";) or as a bracketed white score such as [0.5].
+ *
+ * Each position is resolved to a quiet position with a capture search, then the parameters are
+ * fitted by gradient descent to minimize the squared error between the results and a sigmoid
+ * of the evaluation. Work is split across all cores. The result is written as a C header.
+ */
+
+// Run the tuner; returns false if the positions could not be read
+bool tune(const char *positions_path, const char *header_path, int epochs);
+
+#endif
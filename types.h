@@ -2,6 +2,7 @@
 #define TYPES_H
 
 #include <stdint.h>
+#include <sys/time.h>
 
 /**
  * Types
@@ -10,6 +11,10 @@
  * in an order-dependent capacity.
  */
 
+#define MAX_PV_LENGTH 64 // the longest principal variation tracked by the search
+#define MAX_SEARCH_HEIGHT 128 // the deepest node (main search plus quiescence) from the root
+#define MAX_MOVES 150 // the most moves that can be stored in a move list
+
 typedef enum castle {
 	N, K, Q // castle directions
 } castle;
@@ -45,7 +50,7 @@ typedef enum evaltype {
 typedef struct evaluation {
 	move best;
 	int16_t score;
-	uint16_t last_access_move; // used for age to delete ancient entries; set automatically by the TT
+	uint8_t generation; // the search that last stored or found it, for aging; set automatically by the TT
 	int8_t depth;
 	int8_t type; // evaltype; structure packing
 } evaluation;
@@ -53,6 +58,11 @@ typedef struct evaluation {
 typedef struct board {
 	piece b[8][8]; // cols then rows
 	uint64_t hash;
+	uint64_t pawn_hash; // Zobrist hash of the pawns alone, for the pawn structure cache
+	int mg; // running midgame material and PST sum, from white's perspective
+	int eg; // running endgame material and PST sum, from white's perspective
+	int phase; // weighted count of non-pawn material; max_phase at the start of the game
+	uint8_t piece_counts[12]; // white PNBRQK, then black PNBRQK
 	bool black_to_move;
 	bool castle_rights_wq; // can castle on this side
 	bool castle_rights_wk;
@@ -67,15 +77,28 @@ typedef struct board {
 	int last_move_ply; // the ply number of the last move applied
 
 	// the true ply number of the game, which has no bearing on the current board state
-	// used only for disposing of ancient entries in the transposition table
 	uint16_t true_game_ply_clock;
 	coord white_king;
 	coord black_king;
 
 	// Array of double pawn push history indexed by move ply
 	int8_t *en_passant_pawn_push_col_history;
+
+	// Incremental NNUE accumulators; NULL until the board is first evaluated by the network
+	struct nnue_accumulator *nnue_stack;
+	int nnue_top; // entry for the current position
+	int nnue_overflow; // plies applied beyond the top of the stack
 } board;
 
+typedef struct pvline {
+	move moves[MAX_PV_LENGTH];
+	int length;
+	int score; // from the perspective of the side to move at the root
+} pvline;
+
+// One thread's search counters. Only the owning thread writes them, with relaxed atomic
+// stores (see stat_add), so a reporting thread can read them at any time with stats_snapshot.
+// Blocks are cache-line aligned so that threads never share a line.
 typedef struct searchstats {
 	int depth; // the depth of the current search
 	double time; // time at this depth in ms
@@ -87,9 +110,119 @@ typedef struct searchstats {
 	uint64_t ttable_hits;
 	uint64_t ttable_misses;
 	uint64_t ttable_overwrites;
-} searchstats;
+} __attribute__((aligned(64))) searchstats;
+
+typedef struct timeman {
+	bool enabled; // false for infinite searches, which only end on "stop"
+	bool fixed; // "go movetime"; never scale the budget
+	bool pondering; // "go ponder"; the clock does not run until ponderhit
+	struct timeval start; // when the search was requested
+	int soft_ms; // target time; no new iteration is started past this (scaled by stability)
+	int hard_ms; // the running iteration is aborted at this point
+	int root_moves; // legal moves at the root; a forced move needs no search
+
+	// Updated after every completed iteration
+	move last_best;
+	int last_score;
+	int stable_iterations; // consecutive iterations without a best move change
+	double last_iteration_ms;
+	bool dominance_checked;
+} timeman;
+
+#define TT_BUCKET_ENTRIES 6 // entries sharing one cache line
+
+// One cache line of the transposition table. A position may be kept in any entry of the bucket
+// its hash selects, so a probe reads one line. An entry is ten bytes: a check and a data word,
+// packed as described in ttable.c, and written and read without locks.
+typedef struct tt_bucket {
+	uint16_t checks[TT_BUCKET_ENTRIES]; // the entry's key XOR its data folded to 16 bits
+	uint16_t unused[2];
+	uint64_t data[TT_BUCKET_ENTRIES]; // a packed evaluation; zero, with the check, when empty
+} __attribute__((aligned(64))) tt_bucket;
+
+typedef struct ttable {
+	tt_bucket *buckets; // the start of a private anonymous mapping
+	size_t mapped_bytes; // length of the mapping; at least the buckets, in whole huge pages
+	uint8_t *node_thread_counts; // per bucket
+	uint64_t bucket_count;
+	uint64_t size; // entries
+	uint64_t count; // entries in use
+	uint8_t generation; // advanced by every search; wraps around
+	int megabytes;
+} ttable;
+
+#define TT_TELEMETRY_DEPTHS 16 // depths told apart by the telemetry; deeper ones share the last
+
+// Transposition table instrumentation for one search, kept only with use_tt_telemetry. Written by
+// the owning thread, like searchstats, but not cleared between iterations.
+typedef struct tt_telemetry {
+	uint64_t hit_slots[TT_BUCKET_ENTRIES]; // hits by the bucket entry found in; a miss reads them all
+	uint64_t key_collisions; // keys that matched, but with a move that does not fit the board
+	uint64_t fills; // stores into an empty entry
+	uint64_t updates[6]; // stores over the same position, by the stored entry's evaltype
+	uint64_t refusals[6]; // same-position stores tt_should_replace refused, by the stored evaltype
+	uint64_t evictions[6]; // stores over another position, by the evicted entry's evaltype
+	uint64_t aged_evictions; // evicted entries at least remove_at_age searches old
+	uint64_t eviction_depths[TT_TELEMETRY_DEPTHS]; // by the evicted entry's depth
+	uint64_t probes[TT_TELEMETRY_DEPTHS]; // by the probing node's remaining depth; 0 is quiescence
+	uint64_t hits[TT_TELEMETRY_DEPTHS];
+	uint64_t deep_hits[TT_TELEMETRY_DEPTHS]; // hits searched at least as deep as the node needs
+} tt_telemetry;
+
+// Everything a single search needs. Independent contexts can search concurrently;
+// they may share a transposition table.
+typedef struct search_context {
+	searchstats stats; // set by the last call to search(); first, so it starts on its own cache line
+	bool terminate_requested; // checked at every node; set to stop the search
+	ttable *tt;
+	bool owns_tt; // whether destroying the context frees the table
+
+	// Move lists, one per distance from the root, so nodes never allocate
+	move moves[MAX_SEARCH_HEIGHT][MAX_MOVES];
+	// Quiet move ordering: credit for cutoffs, by side, from-square and to-square
+	int history[2][64][64];
+
+	// Triangular principal variation table, indexed by distance from the root
+	move pv_table[MAX_PV_LENGTH][MAX_PV_LENGTH];
+	int pv_length[MAX_PV_LENGTH];
+	int root_ply; // last_move_ply of the board the search was started from
+
+	// Root moves skipped by the search, for MultiPV
+	move root_excluded[MAX_PV_LENGTH];
+	int root_excluded_count;
+
+	// The first two moves of the last reported PV
+	move pv_move;
+	move pv_reply;
+
+	// NNUE accumulators for the board being searched, kept between searches (see nnue_attach)
+	struct nnue_accumulator *nnue_stack;
+
+	tt_telemetry telemetry; // see use_tt_telemetry
+} search_context;
+
+// The start of a saved transposition table file; the buckets follow, cache-line aligned
+typedef struct tt_file_header {
+	char magic[8];
+	uint32_t version; // of the entry format
+	uint32_t bucket_bytes;
+	uint64_t zobrist_seed; // the keys the entries were hashed with
+	uint64_t bucket_count;
+	uint64_t count;
+	uint8_t generation;
+} __attribute__((aligned(64))) tt_file_header;
+
+// A range of buckets for one of the threads that zero or migrate a transposition table
+typedef struct tt_job {
+	ttable *from; // the table migrated from; NULL to zero
+	ttable *to;
+	uint64_t first; // the buckets [first, last) of to
+	uint64_t last;
+	uint64_t count; // entries migrated
+} tt_job;
 
 typedef struct search_worker_thread_args {
+	search_context *ctx;
 	board *b;
 	int alpha;
 	int beta;
@@ -5,16 +5,39 @@ void read_from_fen(board *b);
 void *search_entrypoint(void *param);
 void *timeout_entrypoint(void *time);
 void kill_workers(bool print);
+void print_bestmove(void);
+move first_legal_move(board *b);
+move ponder_move(board *b, move best);
 void print_pv(board *b_orig, int maxdepth);
+void print_multipv(pvline *lines, int count);
 
 pthread_t search_worker;
 pthread_t timer_worker;
 
+static board uciboard; // the last known board loaded with the position command
+static ttable uci_tt; // sized by the Hash option
+static search_context *uci_ctx; // owns the state of the engine's search
+static bool search_running = false;
+
+static timeman uci_time; // limits for the running search
+static bool timed_search = false; // the timer thread owns the search worker and prints the bestmove
+static bool suppress_bestmove = false;
+static bool search_worker_done = false;
+static int multi_pv = 1; // number of principal variations to report
+static bool ponder_enabled = false; // the GUI allows pondering
+static bool own_book = own_book_default; // play book moves without searching
+static bool keep_hash_on_resize = keep_hash_on_resize_default;
+static char hash_file[max_input_string_length] = ""; // where SaveHash and LoadHash keep the table
+static pvline multipv_lines[max_multi_pv];
+static bool debug_mode = false; // set by "debug on"; dumps the table telemetry with every bestmove
+
 // Called after the engine recieves the string "uci."
 // Configures the engine with the GUI and loops, waiting for commands.
 void enter_uci() {
 	// Assume a new game is beginning for noncompilant engines (that don't send ucinewgame)
-	tt_init();
+	uci_tt.megabytes = tt_megabytes;
+	tt_init(&uci_tt);
+	uci_ctx = search_context_create(&uci_tt);
 	reset_board(&uciboard);
 
 	while (true) {
@@ -36,16 +59,31 @@ void process_command(char *command_str) {
 	} else if (strcmp(first_token, "uci") == 0) {
 		stdout_fprintf(logstr, "id name %s %s\n", engine_name, engine_version);
 		stdout_fprintf(logstr, "id author %s\n", author_name);
-		stdout_fprintf(logstr, "option name Hash type spin default 1000 min 10 max 16000\n");
+		stdout_fprintf(logstr, "option name Hash type spin default %d min 1 max 1048576\n", TT_MEGABYTES_DEFAULT);
+		stdout_fprintf(logstr, "option name KeepHashOnResize type check default %s\n", 
+			keep_hash_on_resize_default ? "true" : "false");
+		stdout_fprintf(logstr, "option name HashFile type string default <empty>\n");
+		stdout_fprintf(logstr, "option name SaveHash type button\n");
+		stdout_fprintf(logstr, "option name LoadHash type button\n");
+		stdout_fprintf(logstr, "option name MultiPV type spin default 1 min 1 max %d\n", max_multi_pv);
+		stdout_fprintf(logstr, "option name Ponder type check default false\n");
+		stdout_fprintf(logstr, "option name EvalFile type string default <empty>\n");
+		stdout_fprintf(logstr, "option name OwnBook type check default %s\n", own_book_default ? "true" : "false");
+		stdout_fprintf(logstr, "option name BookFile type string default <empty>\n");
+		stdout_fprintf(logstr, "option name SyzygyPath type string default <empty>\n");
+		stdout_fprintf(logstr, "option name SyzygyProbeLimit type spin default %d min 0 max %d\n", 
+			syzygy_probe_limit_default, TB_MAX_PIECES);
 		stdout_fprintf(logstr, "info string loading %s %s\n", engine_name, engine_version);
 		// Assume a new game is beginning for noncompilant engines (that don't send ucinewgame)
-		tt_init();
+		tt_init(&uci_tt);
+		search_context_clear(uci_ctx);
 		reset_board(&uciboard);
 		stdout_fprintf(logstr, "uciok\n");
 
 	} else if (strcmp(first_token, "ucinewgame") == 0) { // a new game is starting
 		reset_board(&uciboard);
-		tt_init();
+		tt_init(&uci_tt);
+		search_context_clear(uci_ctx);
 
 	} else if (strcmp(first_token, "setoption") == 0) { // a new game is starting
 		char *option = strtok(NULL, token_sep);
@@ -67,19 +105,123 @@ void process_command(char *command_str) {
 				stdout_fprintf(logstr, "info string invalid hash size selection");
 				return;
 			}
-			if (use_hash_option) tt_megabytes = atoi(size);
-			tt_init();
+			kill_workers(false); // The search probes the buckets being unmapped
+			if (use_hash_option) tt_resize(&uci_tt, atoi(size), keep_hash_on_resize);
+
+		} else if (strcasecmp(option, "KeepHashOnResize") == 0) {
+			option = strtok(NULL, token_sep);
+			char *value = strtok(NULL, token_sep);
+			if (option == NULL || strcmp(option, "value") != 0 || value == NULL) {
+				stdout_fprintf(logstr, "info string invalid KeepHashOnResize selection\n");
+				return;
+			}
+			keep_hash_on_resize = (strcmp(value, "true") == 0);
+
+		} else if (strcasecmp(option, "HashFile") == 0) {
+			option = strtok(NULL, token_sep);
+			char *path = strtok(NULL, "\n"); // Paths may contain spaces
+			if (option == NULL || strcmp(option, "value") != 0) {
+				stdout_fprintf(logstr, "info string invalid HashFile selection\n");
+				return;
+			}
+			if (path == NULL || strcmp(path, "<empty>") == 0) hash_file[0] = '\0';
+			else snprintf(hash_file, sizeof(hash_file), "%s", path);
+
+		} else if (strcasecmp(option, "SaveHash") == 0 || strcasecmp(option, "LoadHash") == 0) {
+			if (hash_file[0] == '\0') {
+				stdout_fprintf(logstr, "info string set HashFile before %s\n", option);
+				return;
+			}
+			if (strcasecmp(option, "SaveHash") == 0) {
+				tt_save_file(&uci_tt, hash_file);
+			} else {
+				kill_workers(false); // The search probes the buckets being overwritten
+				tt_load_file(&uci_tt, hash_file);
+			}
+
+		} else if (strcasecmp(option, "MultiPV") == 0) {
+			option = strtok(NULL, token_sep);
+			char *lines = strtok(NULL, token_sep);
+			if (option == NULL || strcmp(option, "value") != 0 || lines == NULL) {
+				stdout_fprintf(logstr, "info string invalid MultiPV selection\n");
+				return;
+			}
+			multi_pv = max(1, min(max_multi_pv, atoi(lines)));
+
+		} else if (strcasecmp(option, "Ponder") == 0) {
+			option = strtok(NULL, token_sep);
+			char *value = strtok(NULL, token_sep);
+			if (option == NULL || strcmp(option, "value") != 0 || value == NULL) {
+				stdout_fprintf(logstr, "info string invalid Ponder selection\n");
+				return;
+			}
+			ponder_enabled = (strcmp(value, "true") == 0);
+
+		} else if (strcasecmp(option, "EvalFile") == 0) {
+			option = strtok(NULL, token_sep);
+			char *path = strtok(NULL, "\n"); // Paths may contain spaces
+			if (option == NULL || strcmp(option, "value") != 0) {
+				stdout_fprintf(logstr, "info string invalid EvalFile selection\n");
+				return;
+			}
+			kill_workers(false); // The search reads the weights being replaced
+			if (path == NULL || strcmp(path, "<empty>") == 0) nnue_unload();
+			else nnue_load(path);
+			eval_cache_clear(); // Cached scores belong to the previous evaluation
+			tt_wipe(&uci_tt);
+
+		} else if (strcasecmp(option, "OwnBook") == 0) {
+			option = strtok(NULL, token_sep);
+			char *value = strtok(NULL, token_sep);
+			if (option == NULL || strcmp(option, "value") != 0 || value == NULL) {
+				stdout_fprintf(logstr, "info string invalid OwnBook selection\n");
+				return;
+			}
+			own_book = (strcmp(value, "true") == 0);
+
+		} else if (strcasecmp(option, "BookFile") == 0) {
+			option = strtok(NULL, token_sep);
+			char *path = strtok(NULL, "\n"); // Paths may contain spaces
+			if (option == NULL || strcmp(option, "value") != 0) {
+				stdout_fprintf(logstr, "info string invalid BookFile selection\n");
+				return;
+			}
+			book_open(path);
+
+		} else if (strcasecmp(option, "SyzygyPath") == 0) {
+			option = strtok(NULL, token_sep);
+			char *paths = strtok(NULL, "\n"); // Paths may contain spaces
+			if (option == NULL || strcmp(option, "value") != 0) {
+				stdout_fprintf(logstr, "info string invalid SyzygyPath selection\n");
+				return;
+			}
+			kill_workers(false); // The search probes the tables being freed
+			tb_init(paths);
+
+		} else if (strcasecmp(option, "SyzygyProbeLimit") == 0) {
+			option = strtok(NULL, token_sep);
+			char *pieces = strtok(NULL, token_sep);
+			if (option == NULL || strcmp(option, "value") != 0 || pieces == NULL) {
+				stdout_fprintf(logstr, "info string invalid SyzygyProbeLimit selection\n");
+				return;
+			}
+			tb_set_probe_limit(atoi(pieces));
 
 		} else {
 			stdout_fprintf(logstr, "info string unknown \"setoption\" option \"%s\"\n", option);
 			return;
 		}
 
+	} else if (strcmp(first_token, "debug") == 0) { // "debug on" or "debug off"
+		char *mode = strtok(NULL, token_sep);
+		debug_mode = (mode != NULL && strcmp(mode, "on") == 0);
+		if (debug_mode && !use_tt_telemetry) tt_telemetry_print(uci_ctx, true);
+
 	} else if (strcmp(first_token, "quit") == 0) { // terminate engine
 		exit(0);
 
 	} else if (strcmp(first_token, "position") == 0) { // configure the board
-		if (clear_tt_every_move) tt_clear();
+		if (clear_tt_every_move) tt_clear(&uci_tt);
 		char *mode = strtok(NULL, token_sep);
 		if (strcmp(mode, "startpos") == 0) {
 			reset_board(&uciboard);
@@ -119,12 +261,15 @@ void process_command(char *command_str) {
 		int movestogo = -1;
 		int movetime = -1;
 		bool infinite = false;
+		bool ponder = false;
 
 		char *mode = strtok(NULL, token_sep);
 		while (mode != NULL) {
 			if (strcmp(mode, "infinite") == 0) {
 				stdout_fprintf(logstr, "info string infinite search...\n");
 				infinite = true;
+			} else if (strcmp(mode, "ponder") == 0) {
+				ponder = true;
 			} else if (strcmp(mode, "wtime") == 0) {
 				wtime = atoi(strtok(NULL, token_sep));
 			} else if (strcmp(mode, "btime") == 0) {
@@ -142,32 +287,50 @@ void process_command(char *command_str) {
 			}
 			mode = strtok(NULL, token_sep);
 		}
-		// compute the time to be used
-		if (!infinite && movetime == -1) {
-			int timeleft = uciboard.black_to_move ? btime : wtime;
-			int increment = uciboard.black_to_move ? binc : winc;
-			movetime = time_use(&uciboard, timeleft, increment, movestogo);
-		}
+		// stop workers that are already running
+		kill_workers(false);
 
-		if (infinite || wtime <= 0 || btime <= 0) {
-			movetime = -1;
-			infinite = true;
+		// A book move needs no search, or even a thread; pondering on one would gain nothing.
+		// An infinite search must not answer before stop, so it analyzes instead.
+		move book;
+		if (own_book && !ponder && !infinite && book_probe(&uciboard, &book, book_pick_best)) {
+			char buffer[6];
+			stdout_fprintf(logstr, "bestmove %s\n", move_to_string(book, buffer));
+			return;
 		}
 
-		// stop workers that are already running
-		kill_workers(false);
+		tt_new_search(&uci_tt);
+		if (use_tt_telemetry) tt_telemetry_clear(uci_ctx);
+
+		// compute the time to be used
+		int timeleft = uciboard.black_to_move ? btime : wtime;
+		int increment = uciboard.black_to_move ? binc : winc;
+		if (infinite) timeleft = movetime = -1;
+		time_init(&uci_time, &uciboard, timeleft, increment, movestogo, movetime);
+		uci_time.pondering = ponder;
 
 		// spawn the worker thread
-		int *arg = malloc(sizeof(int));
-		*arg = movetime;
-		if (movetime == -1) {
+		search_running = true;
+		uci_ctx->terminate_requested = false;
+		search_worker_done = false;
+		suppress_bestmove = false;
+		timed_search = uci_time.enabled;
+		uci_ctx->pv_move = no_move;
+		uci_ctx->pv_reply = no_move;
+		if (!uci_time.enabled) {
 			if (pthread_create(&search_worker, NULL, &search_entrypoint, NULL) != 0) {
 				stdout_fprintf(logstr, "info string failed to spawn infinite search thread\n");
+				search_running = false;
 			}
-		} else if (pthread_create(&timer_worker, NULL, &timeout_entrypoint, arg) != 0) {
+		} else if (pthread_create(&timer_worker, NULL, &timeout_entrypoint, NULL) != 0) {
 			stdout_fprintf(logstr, "info string failed to spawn timed search thread\n");
+			search_running = false;
 		}
 		
+	} else if (strcmp(first_token, "ponderhit") == 0) { // the opponent played the expected move
+		// The running search continues; it just becomes a timed one
+		if (search_running && uci_time.pondering) time_ponderhit(&uci_time);
+
 	} else if (strcmp(first_token, "stop") == 0) { // end the search
 		kill_workers(true);
 
@@ -218,6 +381,9 @@ void read_from_fen(board *b) {
 	b->last_move_ply = ply;
 	b->true_game_ply_clock = ply;
 	b->hash = tt_hash_position(b);
+	b->pawn_hash = tt_pawn_hash_position(b);
+	eval_refresh(b);
+	nnue_reset(b);
 	for (int i = 0; i < 8; i++) {
 		for (int j = 0; j < 8; j++) {
 			if (b->b[i][j].type == 'K') {
@@ -229,24 +395,77 @@ void read_from_fen(board *b) {
 }
 
 // Kill a search, if it is running, and print the bestmove.
+// A timed search prints its own bestmove from the timer thread, so it is only told whether to.
 void kill_workers(bool print) {
 	if (!search_running) return;
-	search_terminate_requested = true;
-	if (pthread_cancel(timer_worker) != 0) {
-		stdout_fprintf(logstr, "info string failed to terminate timer thread (perhaps it has already been killed?) \n");
+	suppress_bestmove = !print;
+	uci_ctx->terminate_requested = true;
+	if (timed_search) {
+		pthread_join(timer_worker, NULL);
+	} else {
+		pthread_join(search_worker, NULL);
+		if (print) print_bestmove();
 	}
+	search_running = false;
+}
+
+// Prints the bestmove for uciboard from the last completed iteration.
+void print_bestmove(void) {
 	char buffer[6];
-	if (print) {
-		evaluation res;
-		tt_get(&uciboard, &res);
-		move selected_move = res.best;
-		if (!m_eq(last_tt_pv_move, selected_move)) {
-			stdout_fprintf(logstr, "info string Warning: previous pv move and tt move (%s) don't match! Using the former.\n", move_to_string(selected_move, buffer));
-			selected_move = last_tt_pv_move;
-		}
+	evaluation eval;
+	tt_get(uci_ctx, &uciboard, &eval);
+	move selected_move = eval.best;
+	if (m_eq(selected_move, no_move)) { // Panic! The search wasn't long enough to complete depth one. Choose a random legal move.
+		stdout_fprintf(logstr, "info string search depth 1 timeout (or badly-timed tt_clear); choosing random move\n");
+		selected_move = first_legal_move(&uciboard);
+	}
+	if (!m_eq(uci_ctx->pv_move, selected_move) && !m_eq(uci_ctx->pv_move, no_move)) {
+		stdout_fprintf(logstr, "info string Warning: previous pv move and tt move (%s) don't match! Using the former.\n", move_to_string(selected_move, buffer));
+		selected_move = uci_ctx->pv_move;
+	}
+	if (!is_pseudo_legal(&uciboard, selected_move)) { // Panic, we somehow ended up with an illegal move
+		stdout_fprintf(logstr, "info string error: the chosen move was illegal! selecting random move...\n");
+		selected_move = first_legal_move(&uciboard);
+	}
+	if (debug_mode && use_tt_telemetry) tt_telemetry_print(uci_ctx, true);
+	move reply = ponder_enabled ? ponder_move(&uciboard, selected_move) : no_move;
+	if (m_eq(reply, no_move)) {
 		stdout_fprintf(logstr, "bestmove %s\n", move_to_string(selected_move, buffer));
+	} else {
+		char reply_buffer[6];
+		stdout_fprintf(logstr, "bestmove %s ponder %s\n", move_to_string(selected_move, buffer), 
+			move_to_string(reply, reply_buffer));
 	}
-	search_running = false;
+}
+
+// The expected reply to best, from the PV if best was its first move or else from the table.
+// Returns no_move if there is no legal reply to suggest.
+move ponder_move(board *b, move best) {
+	board b_cpy = *b;
+	apply(&b_cpy, best);
+	move reply = m_eq(best, uci_ctx->pv_move) ? uci_ctx->pv_reply : no_move;
+	if (m_eq(reply, no_move)) {
+		evaluation eval;
+		tt_get(uci_ctx, &b_cpy, &eval);
+		reply = eval.best;
+	}
+	if (!is_pseudo_legal(&b_cpy, reply)) return no_move;
+	apply(&b_cpy, reply);
+	coord king_loc = b_cpy.black_to_move ? b_cpy.white_king : b_cpy.black_king; // for side that just moved
+	if (in_check(&b_cpy, king_loc.col, king_loc.row, !b_cpy.black_to_move)) return no_move;
+	return reply;
+}
+
+// Fallback for when the search produced nothing usable.
+move first_legal_move(board *b) {
+	int c;
+	move *moves = board_moves(b, &c, false);
+	if (c <= 0) assert(false);
+	int i = 0;
+	move selected_move = moves[i];
+	while (puts_in_check(b, selected_move, b->black_to_move)) selected_move = moves[++i];
+	free(moves);
+	return selected_move;
 }
 
 // Prints the space-separated moves in the PV, followed by a space.
@@ -257,95 +476,113 @@ void print_pv(board *b_orig, int maxdepth) {
 	board b_cpy = *b_orig;
 	board *b = &b_cpy;
 	evaluation eval;
-	tt_get(b, &eval);
-	last_tt_pv_move = eval.best;
+	tt_get(uci_ctx, b, &eval);
+	uci_ctx->pv_move = eval.best;
+	uci_ctx->pv_reply = no_move;
 	if (e_eq(eval, no_eval) || m_eq(eval.best, no_move)) {
 		stdout_fprintf(logstr, "info string null or no move in ttable");
 		return;
 	}
 	do {
-		if (search_terminate_requested) return;
+		if (uci_ctx->terminate_requested) return;
 		char move[6];
 		stdout_fprintf(logstr, "%s ", move_to_string(eval.best, move));
 		apply(b, eval.best);
-		tt_get(b, &eval);
+		tt_get(uci_ctx, b, &eval);
+		if (curr_depth == maxdepth) uci_ctx->pv_reply = eval.best;
 	} while (!e_eq(eval, no_eval) && !m_eq(eval.best, no_move) && curr_depth-- > 0);
 }
 
-// TODO - ensure cancellation doesn't call the cleanup function
+// Prints one info line per principal variation, best first.
+void print_multipv(pvline *lines, int count) {
+	searchstats stats;
+	stats_snapshot(&uci_ctx, 1, &stats);
+	uint64_t nodes = stats.nodes_searched + stats.qnodes_searched;
+	double nps = (((double) nodes) / (((double) stats.time) / 1000));
+	for (int k = 0; k < count; k++) {
+		stdout_fprintf(logstr, "info depth %d multipv %d time %d nodes %llu score cp %d hashfull %f nps %.0f pv ", 
+			stats.depth, k + 1, (int) stats.time, nodes, lines[k].score, tt_load(&uci_tt) * 10, nps);
+		for (int i = 0; i < lines[k].length && i < pv_printing_cutoff; i++) {
+			char move[6];
+			stdout_fprintf(logstr, "%s ", move_to_string(lines[k].moves[i], move));
+		}
+		stdout_fprintf(logstr, "\n");
+	}
+}
+
 // The entrypoint for a multithreaded position search.
-// This function will perform iterative deepening forever (or until its thread is killed).
+// This function will perform iterative deepening until it is terminated, the depth cutoff is reached,
+// or the time manager decides another iteration is not worthwhile.
 void *search_entrypoint(void *param) { 
-	search_running = true;
-	search_terminate_requested = false; // Reset termination request
-	board working_copy = uciboard; // killing the worker thread might destroy our board
+	board working_copy = uciboard; // the search must not disturb the position
+	if (nnue_active()) nnue_attach(&working_copy, &uci_ctx->nnue_stack); // One stack serves every search
+	for (int i = 0; i < max_multi_pv; i++) multipv_lines[i].length = 0;
+	move tb_move;
+	int tb_score;
+	if (use_syzygy && multi_pv == 1 && tb_probe_root(&working_copy, &tb_move, &tb_score)) {
+		// The tables already know the best move; store it where print_bestmove looks
+		evaluation eval = {.best = tb_move, .score = tb_score, .type = exact, .depth = 1};
+		tt_put(uci_ctx, &working_copy, eval);
+		uci_ctx->pv_move = tb_move;
+		uci_ctx->pv_reply = no_move;
+		char buffer[6];
+		stdout_fprintf(logstr, "info depth 1 score cp %d tbhits 1 pv %s\n", tb_score, move_to_string(tb_move, buffer));
+		search_worker_done = true;
+		return NULL;
+	}
 	for (int i = 1; i <= iterative_deepening_cutoff; i++) { 
-		clear_stats();
-		search(&working_copy, i);
-		if (search_terminate_requested) break;
+		clear_stats(uci_ctx);
+		if (multi_pv > 1) {
+			int found = search_multipv(uci_ctx, &working_copy, i, multi_pv, multipv_lines);
+			if (uci_ctx->terminate_requested || found == 0) break;
+			print_multipv(multipv_lines, found);
+			searchstats multipv_stats;
+			stats_snapshot(&uci_ctx, 1, &multipv_stats);
+			uci_ctx->pv_move = multipv_lines[0].moves[0];
+			uci_ctx->pv_reply = multipv_lines[0].length > 1 ? multipv_lines[0].moves[1] : no_move;
+			if (time_stop_iterating(&uci_time, uci_ctx, &working_copy, i, multipv_lines[0].moves[0], 
+				multipv_lines[0].score, multipv_stats.time)) break;
+			continue;
+		}
+		search(uci_ctx, &working_copy, i);
+		if (uci_ctx->terminate_requested) break;
 		evaluation eval;
-		tt_get(&working_copy, &eval);
-		uint64_t nodes = sstats.nodes_searched + sstats.qnodes_searched;
-		double nps = (((double) nodes) / (((double) sstats.time) / 1000));
+		tt_get(uci_ctx, &working_copy, &eval);
+		searchstats stats;
+		stats_snapshot(&uci_ctx, 1, &stats);
+		uint64_t nodes = stats.nodes_searched + stats.qnodes_searched;
+		double nps = (((double) nodes) / (((double) stats.time) / 1000));
 		stdout_fprintf(logstr, "info depth %d time %d nodes %llu score cp %d hashfull %f nps %.0f pv ", 
-			sstats.depth, (int) sstats.time, nodes, eval.score, tt_load() * 10, nps);
-		if (search_terminate_requested) printf("info string (terminated -- incomplete search)\n");
+			stats.depth, (int) stats.time, nodes, eval.score, tt_load(&uci_tt) * 10, nps);
+		if (uci_ctx->terminate_requested) printf("info string (terminated -- incomplete search)\n");
 		print_pv(&working_copy, pv_printing_cutoff);
 		stdout_fprintf(logstr, "\n");
 		fflush(stdout);
+		if (time_stop_iterating(&uci_time, uci_ctx, &working_copy, i, eval.best, eval.score, stats.time)) break;
 	}
+	search_worker_done = true;
 	return NULL;
 }
 
-// spawns a search worker, then kills it after the elapsed time in ms and prints the bestmove
-void *timeout_entrypoint(void *time_p) {
-	int time = *((int *) time_p);
-	free(time_p);
-	move selected_move = no_move;
-	search_running = true;
-	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+// spawns a search worker, then waits for it to stop on its own or stops it at the hard limit, 
+// and prints the bestmove unless the search was cancelled silently
+void *timeout_entrypoint(void *param) {
+	(void) param;
 	// spawn the worker thread
 	if (pthread_create(&search_worker, NULL, search_entrypoint, NULL) != 0) {
 		stdout_fprintf(logstr, "info string failed to spawn timed search thread\n");
+		return NULL;
 	}
 
-	// Wait in microseconds
-	usleep(time * 1000);
+	// Poll every millisecond until the worker finishes or the hard limit expires
+	// While pondering, wait for ponderhit or stop even if the worker has finished
+	while (!uci_ctx->terminate_requested && (uci_time.pondering || 
+		(!search_worker_done && time_elapsed(&uci_time) < uci_time.hard_ms))) {
+		usleep(1000);
+	}
 
-	search_terminate_requested = true;
-	//usleep(1000); // Wait 1 ms in case the PV hasn't finished printing
+	uci_ctx->terminate_requested = true;
 	pthread_join(search_worker, NULL);
-
-	char buffer[6];
-	evaluation eval;
-	tt_get(&uciboard, &eval);
-	selected_move = eval.best;
-	if (m_eq(selected_move, no_move)) { // Panic! The search wasn't long enough to complete depth one. Choose a random legal move.
-		stdout_fprintf(logstr, "info string search depth 1 timeout (or badly-timed tt_clear); choosing random move\n");
-		int c;
-		move *moves = board_moves(&uciboard, &c, false);
-		if (c <= 0) assert(false);
-		int i = 0;
-		selected_move = moves[i];
-		while (puts_in_check(&uciboard, selected_move, uciboard.black_to_move)) selected_move = moves[++i];
-		free(moves);
-	}
-	if (!m_eq(last_tt_pv_move, selected_move)) {
-		stdout_fprintf(logstr, "info string Warning: previous pv move and tt move (%s) don't match! Using the former.\n", move_to_string(selected_move, buffer));
-		selected_move = last_tt_pv_move;
-	}
-	if (!is_legal_move(&uciboard, selected_move)) { // Panic, we somehow ended up with an illegal move
-		stdout_fprintf(logstr, "info string error: the chosen move was illegal! selecting random move...\n");
-		int c;
-		move *moves = board_moves(&uciboard, &c, false);
-		if (c <= 0) assert(false);
-		int i = 0;
-		selected_move = moves[i];
-		while (puts_in_check(&uciboard, selected_move, uciboard.black_to_move)) selected_move = moves[++i];
-		free(moves);
-	}
-	stdout_fprintf(logstr, "bestmove %s\n", move_to_string(selected_move, buffer));
-	search_running = false;
+	if (!suppress_bestmove) print_bestmove();
 	return NULL;
 }
-
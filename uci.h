@@ -10,16 +10,13 @@
 #include "settings.h"
 #include "types.h"
 #include "util.h"
+#include "book.h"
 #include "movegen.h"
 #include "search.h"
 #include "ttable.h"
 
 static const char *token_sep = " \t\n"; // characters that can separate tokens in a UCI input string
 
-static board uciboard; // the last known board loaded with the position command
-
-static bool search_running = false;
-static move last_tt_pv_move;
 extern pthread_t search_worker;
 extern pthread_t timer_worker;
 
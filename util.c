@@ -42,6 +42,9 @@ void reset_board(board *b) {
 	b->castle_bk_lost_on_ply = -1;
 	b->last_move_ply = 0;
 	b->hash = tt_hash_position(b);
+	b->pawn_hash = tt_pawn_hash_position(b);
+	eval_refresh(b);
+	nnue_reset(b);
 	b->true_game_ply_clock = 0;
 	b->white_king = (coord){4, 0};
 	b->black_king = (coord){4, 7};
@@ -28,6 +28,16 @@ extern const char *author_name;
 
 extern FILE *logstr;
 
+// Add to a search counter owned by the calling thread. Relaxed atomics compile to a plain add,
+// but let other threads read the counter without a data race.
+static inline void stat_add(uint64_t *counter, uint64_t n) {
+	__atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static inline void stat_set(uint64_t *counter, uint64_t value) {
+	__atomic_store_n(counter, value, __ATOMIC_RELAXED);
+}
+
 static inline bool p_eq(piece a, piece b) {
 	return a.type == b.type && a.white == b.white;
 }
@@ -47,7 +57,7 @@ static inline bool m_eq_without_en_passant(move a, move b) {
 }
 
 static inline bool e_eq(evaluation a, evaluation b) {
-	return m_eq(a.best, b.best) && a.score == b.score && a.last_access_move == b.last_access_move 
+	return m_eq(a.best, b.best) && a.score == b.score && a.generation == b.generation 
 		&& a.depth == b.depth && a.type == b.type;
 }
 
@@ -55,6 +65,27 @@ static inline bool in_bounds(coord c) {
 	return c.row <= 7 && c.col <= 7; // coordinates are unsigned
 }
 
+// The index of a piece in tables ordered white PNBRQK, then black PNBRQK
+static inline int piece_index(piece p) {
+	int idx;
+	switch (p.type) {
+		case 'P': idx = 0; break;
+		case 'N': idx = 1; break;
+		case 'B': idx = 2; break;
+		case 'R': idx = 3; break;
+		case 'Q': idx = 4; break;
+		default: idx = 5; // King
+	}
+	return p.white ? idx : idx + 6;
+}
+
+// Piece counts (indexed as piece_index) packed four bits apiece; equal exactly when material is
+static inline uint64_t material_key(const uint8_t *piece_counts) {
+	uint64_t key = 0;
+	for (int i = 0; i < 12; i++) key |= (uint64_t) piece_counts[i] << (4 * i);
+	return key;
+}
+
 static inline piece at(const board *b, coord c) {
 	return b->b[c.col][c.row];
 }